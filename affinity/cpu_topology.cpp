@@ -0,0 +1,182 @@
+#include "cpu_topology.h"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <set>
+#include <dirent.h>
+
+namespace {
+
+const std::string cpu_root = "/sys/devices/system/cpu";
+const std::string node_root = "/sys/devices/system/node";
+
+std::string read_first_line(const std::string& path) {
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+void add_group(std::vector<std::vector<int>>& groups, std::vector<int> group, const std::set<int>& allowed) {
+    group.erase(std::remove_if(group.begin(), group.end(), [&](int c) { return !allowed.count(c); }),
+                group.end());
+    if (group.empty()) return;
+    if (std::find(groups.begin(), groups.end(), group) == groups.end()) {
+        groups.push_back(std::move(group));
+    }
+}
+
+//! One cpu number: digits only and below CPU_SETSIZE, which is the most
+//  a cpu_set_t (and so sched_setaffinity) can hold.
+bool parse_cpu(const std::string& text, int& cpu) {
+    if (text.empty() || text.size() > 6 || !std::all_of(text.begin(), text.end(), ::isdigit)) return false;
+    cpu = std::stoi(text);
+    return cpu < CPU_SETSIZE;
+}
+
+} // namespace
+
+bool parse_cpu_list(const std::string& list, std::vector<int>& cpus) {
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) end = list.size();
+        std::string range = list.substr(pos, end - pos);
+        pos = end + 1;
+        if (range.empty()) continue;
+        size_t dash = range.find('-');
+        int first, last;
+        if (!parse_cpu(range.substr(0, dash), first)) return false;
+        if (dash == std::string::npos) last = first;
+        else if (!parse_cpu(range.substr(dash + 1), last)) return false;
+        if (last < first) return false;
+        for (int c = first; c <= last; ++c) cpus.push_back(c);
+    }
+    return true;
+}
+
+void cpu_topology::load() {
+    is_loaded = true;
+    std::vector<int> online;
+    if (!parse_cpu_list(read_first_line(cpu_root + "/online"), online)) return;
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    bool have_mask = sched_getaffinity(0, sizeof(mask), &mask) == 0;
+    std::set<int> allowed;
+    for (int c : online) {
+        if (!have_mask || (c < CPU_SETSIZE && CPU_ISSET(c, &mask))) allowed.insert(c);
+    }
+    usable.assign(allowed.begin(), allowed.end());
+
+    for (int c : usable) {
+        std::string cache_dir = cpu_root + "/cpu" + std::to_string(c) + "/cache";
+        for (int idx = 0; ; ++idx) {
+            std::string index_dir = cache_dir + "/index" + std::to_string(idx);
+            std::string level = read_first_line(index_dir + "/level");
+            if (level.empty()) break;
+            if (read_first_line(index_dir + "/type") == "Instruction") continue;
+            std::vector<int> shared;
+            if (!parse_cpu_list(read_first_line(index_dir + "/shared_cpu_list"), shared)) continue;
+            if (level == "2") add_group(l2_groups, std::move(shared), allowed);
+            else if (level == "3") add_group(l3_groups, std::move(shared), allowed);
+        }
+        std::vector<int> siblings;
+        std::string siblings_path = cpu_root + "/cpu" + std::to_string(c) + "/topology/thread_siblings_list";
+        bool have_siblings = parse_cpu_list(read_first_line(siblings_path), siblings) && !siblings.empty();
+        core_of[c] = have_siblings ? *std::min_element(siblings.begin(), siblings.end()) : c;
+    }
+
+    if (DIR* d = opendir(node_root.c_str())) {
+        while (dirent* ent = readdir(d)) {
+            std::string name = ent->d_name;
+            if (name.rfind("node", 0) != 0 || name.size() == 4) continue;
+            std::vector<int> node;
+            if (parse_cpu_list(read_first_line(node_root + "/" + name + "/cpulist"), node)) {
+                add_group(node_groups, std::move(node), allowed);
+            }
+        }
+        closedir(d);
+    }
+
+    // No cache information (some VMs): treat the whole machine as one domain.
+    if (l3_groups.empty() && !usable.empty()) l3_groups.push_back(usable);
+}
+
+std::vector<int> cpu_topology::by_core(const std::vector<int>& group) const {
+    std::vector<int> ordered;
+    std::vector<int> siblings;
+    std::set<int> cores;
+    for (int c : group) {
+        auto it = core_of.find(c);
+        int core = it == core_of.end() ? c : it->second;
+        (cores.insert(core).second ? ordered : siblings).push_back(c);
+    }
+    ordered.insert(ordered.end(), siblings.begin(), siblings.end());
+    return ordered;
+}
+
+size_t cpu_topology::core_count(const std::vector<int>& group) const {
+    std::set<int> cores;
+    for (int c : group) {
+        auto it = core_of.find(c);
+        cores.insert(it == core_of.end() ? c : it->second);
+    }
+    return cores.size();
+}
+
+std::vector<int> cpu_topology::place_pipeline(size_t stages) {
+    std::vector<int> placement;
+    if (usable.empty() || stages == 0) return placement;
+
+    // Domains are sized in physical cores: an L2 shared only by the SMT
+    // siblings of one core would otherwise put two busy stages on one core.
+    const std::vector<int>* chosen = nullptr;
+    for (const auto* groups : {&l2_groups, &l3_groups, &node_groups}) {
+        std::vector<const std::vector<int>*> fitting;
+        for (const auto& g : *groups) {
+            if (core_count(g) >= stages) fitting.push_back(&g);
+        }
+        if (!fitting.empty()) {
+            // Rotate between equal domains so concurrent pipelines do not pile up.
+            chosen = fitting[next_group++ % fitting.size()];
+            break;
+        }
+    }
+    if (!chosen) {
+        chosen = &*std::max_element(l3_groups.begin(), l3_groups.end(),
+                                    [](const auto& a, const auto& b) { return a.size() < b.size(); });
+    }
+    // One CPU per physical core first; siblings only once every core has a stage.
+    std::vector<int> cpus = by_core(*chosen);
+    for (size_t i = 0; i < stages; ++i) {
+        placement.push_back(cpus[i % cpus.size()]);
+    }
+    return placement;
+}
+
+std::vector<int> cpu_topology::place_spread(size_t stages) const {
+    std::vector<int> placement;
+    if (l3_groups.empty()) return placement;
+    for (size_t i = 0; i < stages; ++i) {
+        const auto& g = l3_groups[i % l3_groups.size()];
+        placement.push_back(g[(i / l3_groups.size()) % g.size()]);
+    }
+    return placement;
+}
+
+std::vector<int> cpu_topology::node_cpus(int node) const {
+    std::vector<int> cpus;
+    parse_cpu_list(read_first_line(node_root + "/node" + std::to_string(node) + "/cpulist"), cpus);
+    return cpus;
+}
+
+bool pin_to_cpus(const std::vector<int>& cpus) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int c : cpus) {
+        if (c >= 0 && c < CPU_SETSIZE) CPU_SET(c, &mask);
+    }
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+}
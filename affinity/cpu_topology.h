@@ -0,0 +1,54 @@
+#ifndef MYSHELL_CPU_TOPOLOGY_H
+#define MYSHELL_CPU_TOPOLOGY_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sched.h>
+
+//! Parses kernel cpu lists such as "0-3,8,10-11".
+//  Returns false on malformed input or cpus beyond CPU_SETSIZE.
+bool parse_cpu_list(const std::string& list, std::vector<int>& cpus);
+
+//! CPU and cache layout read from /sys/devices/system/cpu.
+//  Only CPUs that are online and in the shell's own affinity mask are used.
+class cpu_topology {
+public:
+    cpu_topology() = default;
+
+    void load();
+    [[nodiscard]] bool loaded() const { return is_loaded; }
+
+    //! One CPU per pipeline stage, all taken from the smallest cache domain
+    //  (L2, then L3, then NUMA node) with a physical core for every stage,
+    //  so neighbouring stages exchange pipe buffers through a shared cache.
+    //  SMT siblings are only used once every core of the domain has a stage;
+    //  wraps around inside the largest domain if the pipeline is longer.
+    [[nodiscard]] std::vector<int> place_pipeline(size_t stages);
+
+    //! The opposite placement: consecutive stages in different last-level
+    //  cache domains. Only useful to measure what close placement saves.
+    [[nodiscard]] std::vector<int> place_spread(size_t stages) const;
+
+    [[nodiscard]] std::vector<int> node_cpus(int node) const;
+    [[nodiscard]] size_t llc_domains() const { return l3_groups.size(); }
+    [[nodiscard]] const std::vector<int>& cpus() const { return usable; }
+
+private:
+    //! group reordered so that one CPU of each physical core comes first.
+    [[nodiscard]] std::vector<int> by_core(const std::vector<int>& group) const;
+    [[nodiscard]] size_t core_count(const std::vector<int>& group) const;
+
+    bool is_loaded = false;
+    std::vector<int> usable;
+    std::vector<std::vector<int>> l2_groups;
+    std::vector<std::vector<int>> l3_groups;
+    std::vector<std::vector<int>> node_groups;
+    std::map<int, int> core_of;   // cpu -> lowest-numbered SMT sibling
+    size_t next_group = 0;
+};
+
+//! Pins the calling thread (and so everything it forks afterwards).
+bool pin_to_cpus(const std::vector<int>& cpus);
+
+#endif //MYSHELL_CPU_TOPOLOGY_H
@@ -0,0 +1,120 @@
+// Pipeline throughput with and without CPU placement.
+//
+// Usage: pipe_affinity_bench [MiB per run] [max stages] [runs]
+//
+// Every stage is a forked process: the first one writes the data, the middle
+// ones copy stdin to stdout and the last one discards it -- the same shape as
+// `producer | filter | ... | consumer` in the shell. Each configuration is
+// run several times and the best throughput is reported.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "cpu_topology.h"
+
+namespace {
+
+constexpr size_t chunk_size = 64 * 1024;
+
+void copy_stage(int in, int out, size_t total) {
+    std::vector<char> buf(chunk_size, 'x');
+    if (in == -1) {
+        for (size_t sent = 0; sent < total; ) {
+            ssize_t n = write(out, buf.data(), std::min(chunk_size, total - sent));
+            if (n <= 0) _exit(1);
+            sent += n;
+        }
+        _exit(0);
+    }
+    ssize_t n;
+    while ((n = read(in, buf.data(), chunk_size)) > 0) {
+        if (out != -1) {
+            for (ssize_t done = 0; done < n; ) {
+                ssize_t w = write(out, buf.data() + done, n - done);
+                if (w <= 0) _exit(1);
+                done += w;
+            }
+        }
+    }
+    _exit(0);
+}
+
+double run_pipeline(size_t stages, size_t total, const std::vector<int>& placement) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<pid_t> pids;
+    int prev_read = -1;
+    for (size_t i = 0; i < stages; ++i) {
+        int fd[2] = {-1, -1};
+        bool last = i + 1 == stages;
+        if (!last && pipe(fd) == -1) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (!placement.empty()) pin_to_cpus({placement[i]});
+            if (fd[0] != -1) close(fd[0]);
+            copy_stage(prev_read, fd[1], total);
+        }
+        pids.push_back(pid);
+        if (prev_read != -1) close(prev_read);
+        if (fd[1] != -1) close(fd[1]);
+        prev_read = fd[0];
+    }
+    for (pid_t pid : pids) {
+        waitpid(pid, nullptr, 0);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(total) / (1024.0 * 1024.0) / elapsed.count();
+}
+
+double best_of(size_t runs, size_t stages, size_t total, const std::vector<int>& placement) {
+    double best = 0;
+    for (size_t r = 0; r < runs; ++r) {
+        best = std::max(best, run_pipeline(stages, total, placement));
+    }
+    return best;
+}
+
+std::string describe(const std::vector<int>& placement) {
+    std::string res;
+    for (int c : placement) {
+        res += (res.empty() ? "" : ",") + std::to_string(c);
+    }
+    return res;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t mib = argc > 1 ? std::stoul(argv[1]) : 1024;
+    size_t max_stages = argc > 2 ? std::stoul(argv[2]) : 4;
+    size_t runs = argc > 3 ? std::stoul(argv[3]) : 3;
+    size_t total = mib * 1024 * 1024;
+
+    cpu_topology topology;
+    topology.load();
+    printf("%zu usable CPUs, %zu last-level cache domains, %zu MiB per run, best of %zu\n",
+           topology.cpus().size(), topology.llc_domains(), mib, runs);
+    printf("%-7s %-9s %12s  %s\n", "stages", "placement", "MiB/s", "cpus");
+
+    for (size_t stages = 2; stages <= max_stages; ++stages) {
+        printf("%-7zu %-9s %12.1f\n", stages, "kernel", best_of(runs, stages, total, {}));
+
+        auto pinned = topology.place_pipeline(stages);
+        printf("%-7zu %-9s %12.1f  %s\n", stages, "pinned", best_of(runs, stages, total, pinned),
+               describe(pinned).c_str());
+
+        if (topology.llc_domains() > 1) {
+            auto spread = topology.place_spread(stages);
+            printf("%-7zu %-9s %12.1f  %s\n", stages, "spread", best_of(runs, stages, total, spread),
+                   describe(spread).c_str());
+        }
+    }
+    return 0;
+}
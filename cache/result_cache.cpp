@@ -0,0 +1,289 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+//! FNV-1a, 128-bit variant. Not cryptographic, but wide enough that
+//  accidental collisions between fingerprints are not a concern.
+class fnv128 {
+public:
+    void update(const char* data, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            h ^= static_cast<unsigned char>(data[i]);
+            h *= prime;
+        }
+    }
+    void update(const std::string& s) { update(s.data(), s.size()); }
+
+    [[nodiscard]] std::string hex() const {
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx",
+                 static_cast<unsigned long long>(h >> 64), static_cast<unsigned long long>(h));
+        return buf;
+    }
+
+private:
+    static constexpr unsigned __int128 prime =
+        (static_cast<unsigned __int128>(0x0000000001000000ULL) << 64) | 0x000000000000013BULL;
+    unsigned __int128 h =
+        (static_cast<unsigned __int128>(0x6c62272e07bb0142ULL) << 64) | 0x62b821756295c58dULL;
+};
+
+const std::string entry_magic = "mcache 1";
+const std::string stats_name = "stats";
+
+bool hash_file(const std::string& path, std::string& digest) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    fnv128 h;
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        h.update(buf, n);
+    }
+    close(fd);
+    if (n < 0) return false;
+    digest = h.hex();
+    return true;
+}
+
+std::string resolve_program(const std::string& name) {
+    if (name.find('/') != std::string::npos) return name;
+    const char* path = std::getenv("PATH");
+    std::stringstream ss(path ? path : "");
+    std::string dir;
+    while (std::getline(ss, dir, ':')) {
+        std::string candidate = (dir.empty() ? "." : dir) + "/" + name;
+        if (access(candidate.c_str(), X_OK) == 0) return candidate;
+    }
+    return name;
+}
+
+struct entry_file {
+    fs::path path;
+    fs::file_time_type mtime;
+    uint64_t size;
+};
+
+std::vector<entry_file> list_entries(const std::string& dir) {
+    std::vector<entry_file> entries;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it.depth() != 1 || !it->is_regular_file(ec)) continue;
+        if (it->path().filename().string().find(".tmp.") != std::string::npos) continue;
+        entries.push_back({it->path(), it->last_write_time(ec), static_cast<uint64_t>(it->file_size(ec))});
+    }
+    return entries;
+}
+
+} // namespace
+
+result_cache::result_cache(std::string dir) : dir(std::move(dir)) {}
+
+std::string result_cache::default_dir() {
+    if (const char* d = std::getenv("MSHELL_CACHE_DIR")) return d;
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME")) return std::string(xdg) + "/mshell/mcache";
+    const char* home = std::getenv("HOME");
+    return std::string(home ? home : "/tmp") + "/.cache/mshell/mcache";
+}
+
+uint64_t result_cache::default_limit() {
+    if (const char* size = std::getenv("MSHELL_CACHE_SIZE")) {
+        char* end;
+        unsigned long long mib = strtoull(size, &end, 10);
+        if (end != size) return mib * 1024 * 1024;
+    }
+    return 256ULL * 1024 * 1024;
+}
+
+bool result_cache::describe(const std::vector<std::string>& argv, const std::vector<std::string>& env_vars,
+                            const std::vector<std::string>& inputs, const std::string* stdin_data, bool by_mtime,
+                            std::string& descriptor, std::string& error) const {
+    std::ostringstream desc;
+    std::error_code ec;
+    desc << "cwd " << fs::current_path(ec).string() << '\n';
+    // Lengths first, so that no two different argv lists serialize the same.
+    for (const auto& arg : argv) {
+        desc << "arg " << arg.size() << ' ' << arg << '\n';
+    }
+    // The program itself is an input too: a rebuilt tool must not replay old output.
+    struct stat exe{};
+    if (!argv.empty() && stat(resolve_program(argv[0]).c_str(), &exe) == 0) {
+        desc << "exe " << exe.st_size << ' ' << exe.st_ino << ' ' << exe.st_mtim.tv_sec << '.'
+             << exe.st_mtim.tv_nsec << '\n';
+    }
+    for (const auto& var : env_vars) {
+        const char* value = std::getenv(var.c_str());
+        desc << "env " << var << (value ? "=" + std::string(value) : " unset") << '\n';
+    }
+    for (const auto& input : inputs) {
+        struct stat st{};
+        if (stat(input.c_str(), &st) != 0) {
+            error = "Cannot stat input file " + input;
+            return false;
+        }
+        desc << "input " << input.size() << ' ' << input << ' ';
+        if (by_mtime) {
+            desc << st.st_size << ' ' << st.st_ino << ' ' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec;
+        } else {
+            std::string digest;
+            if (!hash_file(input, digest)) {
+                error = "Cannot read input file " + input;
+                return false;
+            }
+            desc << digest;
+        }
+        desc << '\n';
+    }
+    if (stdin_data) {
+        fnv128 h;
+        h.update(*stdin_data);
+        desc << "stdin " << stdin_data->size() << ' ' << h.hex() << '\n';
+    }
+    descriptor = desc.str();
+    return true;
+}
+
+std::string result_cache::entry_path(const std::string& descriptor) const {
+    fnv128 h;
+    h.update(descriptor);
+    std::string key = h.hex();
+    return dir + "/" + key.substr(0, 2) + "/" + key;
+}
+
+bool result_cache::lookup(const std::string& descriptor, cached_result& result) {
+    std::string path = entry_path(descriptor);
+    std::ifstream file(path, std::ios::binary);
+    std::string magic;
+    size_t desc_size = 0, out_size = 0, err_size = 0;
+    bool hit = file && std::getline(file, magic) && magic == entry_magic &&
+               (file >> result.status >> desc_size >> out_size >> err_size) && file.get() == '\n';
+    if (hit) {
+        std::string stored_desc(desc_size, '\0');
+        result.out.assign(out_size, '\0');
+        result.err.assign(err_size, '\0');
+        file.read(stored_desc.data(), desc_size);
+        file.read(result.out.data(), out_size);
+        file.read(result.err.data(), err_size);
+        // The full descriptor is stored, so a key collision is a miss, not a wrong answer.
+        hit = file && stored_desc == descriptor;
+    }
+    if (hit) {
+        utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    }
+    update_counters(hit ? 1 : 0, hit ? 0 : 1, 0);
+    return hit;
+}
+
+void result_cache::store(const std::string& descriptor, const cached_result& result) {
+    std::string path = entry_path(descriptor);
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+    if (ec) return;
+
+    std::string tmp = path + ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        file << entry_magic << '\n'
+             << result.status << ' ' << descriptor.size() << ' ' << result.out.size() << ' '
+             << result.err.size() << '\n'
+             << descriptor << result.out << result.err;
+        if (!file) {
+            fs::remove(tmp, ec);
+            return;
+        }
+    }
+    struct stat old{};
+    int64_t delta = stat(path.c_str(), &old) == 0 ? -static_cast<int64_t>(old.st_size) : 0;
+    struct stat st{};
+    if (stat(tmp.c_str(), &st) != 0 || rename(tmp.c_str(), path.c_str()) != 0) {
+        fs::remove(tmp, ec);
+        return;
+    }
+    delta += st.st_size;
+    update_counters(0, 0, delta);
+    uint64_t limit = default_limit();
+    if (read_counters().bytes > limit) evict(limit);
+}
+
+void result_cache::evict(uint64_t limit) {
+    auto entries = list_entries(dir);
+    std::sort(entries.begin(), entries.end(),
+              [](const entry_file& a, const entry_file& b) { return a.mtime < b.mtime; });
+    uint64_t total = 0;
+    for (const auto& e : entries) total += e.size;
+
+    // Trim to 90% of the limit so that the next few stores do not evict again.
+    uint64_t target = limit / 10 * 9;
+    std::error_code ec;
+    for (const auto& e : entries) {
+        if (total <= target) break;
+        if (fs::remove(e.path, ec)) total -= e.size;
+    }
+    update_counters(0, 0, static_cast<int64_t>(total), true);
+}
+
+cache_stats result_cache::read_counters() const {
+    cache_stats s;
+    FILE* f = fopen((dir + "/" + stats_name).c_str(), "r");
+    if (f) {
+        if (fscanf(f, "%" SCNu64 " %" SCNu64 " %" SCNu64, &s.hits, &s.misses, &s.bytes) != 3) s = {};
+        fclose(f);
+    }
+    return s;
+}
+
+void result_cache::update_counters(int64_t hits, int64_t misses, int64_t bytes, bool absolute_bytes) {
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    int fd = open((dir + "/" + stats_name).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) return;
+    // The lock is released when fclose() closes the descriptor.
+    flock(fd, LOCK_EX);
+    FILE* f = fdopen(fd, "r+");
+    if (!f) {
+        close(fd);
+        return;
+    }
+    cache_stats s;
+    if (fscanf(f, "%" SCNu64 " %" SCNu64 " %" SCNu64, &s.hits, &s.misses, &s.bytes) != 3) s = {};
+    s.hits += hits;
+    s.misses += misses;
+    if (absolute_bytes) s.bytes = bytes;
+    else s.bytes = bytes < 0 && static_cast<uint64_t>(-bytes) > s.bytes ? 0 : s.bytes + bytes;
+    rewind(f);
+    fprintf(f, "%" PRIu64 " %" PRIu64 " %" PRIu64 "\n", s.hits, s.misses, s.bytes);
+    fflush(f);
+    if (ftruncate(fd, ftell(f)) != 0) perror("mcache: cannot update stats");
+    fclose(f);
+}
+
+cache_stats result_cache::stats() const {
+    cache_stats s = read_counters();
+    auto entries = list_entries(dir);
+    s.entries = entries.size();
+    s.bytes = 0;
+    for (const auto& e : entries) s.bytes += e.size;
+    return s;
+}
+
+void result_cache::clear() {
+    std::error_code ec;
+    for (const auto& e : list_entries(dir)) {
+        fs::remove(e.path, ec);
+    }
+    fs::remove((dir + "/" + stats_name), ec);
+}
@@ -0,0 +1,59 @@
+#ifndef MYSHELL_RESULT_CACHE_H
+#define MYSHELL_RESULT_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct cached_result {
+    int status = 0;
+    std::string out;
+    std::string err;
+};
+
+struct cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t entries = 0;
+    uint64_t bytes = 0;
+};
+
+//! On-disk store of command results, addressed by a hash of everything the
+//  result depends on. Each entry is one file written with rename(), so
+//  concurrent shells can share a store. Entry mtimes serve as the LRU clock.
+class result_cache {
+public:
+    explicit result_cache(std::string dir = default_dir());
+
+    //! $MSHELL_CACHE_DIR, else $XDG_CACHE_HOME/mshell/mcache, else ~/.cache/mshell/mcache.
+    static std::string default_dir();
+    //! $MSHELL_CACHE_SIZE in MiB, 256 by default.
+    static uint64_t default_limit();
+
+    //! Builds the text every cached result is keyed on: cwd, argv, the
+    //  program's size and mtime, the selected environment variables, a
+    //  fingerprint of each input
+    //  file -- its contents, or with by_mtime its size, inode and mtime --
+    //  and a digest of stdin_data, the here-doc fed to stdin, if given.
+    //  Returns false and sets error if an input cannot be read.
+    bool describe(const std::vector<std::string>& argv, const std::vector<std::string>& env_vars,
+                  const std::vector<std::string>& inputs, const std::string* stdin_data, bool by_mtime,
+                  std::string& descriptor, std::string& error) const;
+
+    bool lookup(const std::string& descriptor, cached_result& result);
+    void store(const std::string& descriptor, const cached_result& result);
+
+    [[nodiscard]] cache_stats stats() const;
+    void clear();
+    [[nodiscard]] const std::string& directory() const { return dir; }
+
+private:
+    [[nodiscard]] std::string entry_path(const std::string& descriptor) const;
+    [[nodiscard]] cache_stats read_counters() const;
+    void update_counters(int64_t hits, int64_t misses, int64_t bytes, bool absolute_bytes = false);
+    void evict(uint64_t limit);
+
+    std::string dir;
+};
+
+#endif //MYSHELL_RESULT_CACHE_H
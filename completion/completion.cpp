@@ -0,0 +1,333 @@
+#include "completion.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <csignal>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <readline/readline.h>
+
+namespace {
+
+constexpr uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+bool is_executable(const std::string& path) {
+    struct stat st{};
+    if (stat(path.c_str(), &st) != 0) return false;
+    return S_ISREG(st.st_mode) && (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+}
+
+//! PATH directories, each only once: aliases of one directory (such as
+//  /bin and /usr/bin on merged-usr systems) share an inotify watch, so
+//  their names must be counted once too.
+std::vector<std::string> path_dirs() {
+    std::vector<std::string> dirs;
+    std::set<std::pair<dev_t, ino_t>> seen;
+    const char* path = std::getenv("PATH");
+    if (!path) return dirs;
+    std::stringstream ss(path);
+    std::string dir;
+    while (std::getline(ss, dir, ':')) {
+        if (dir.empty()) dir = ".";
+        struct stat st{};
+        bool is_new = stat(dir.c_str(), &st) == 0
+                          ? seen.emplace(st.st_dev, st.st_ino).second
+                          : std::find(dirs.begin(), dirs.end(), dir) == dirs.end();
+        if (is_new) dirs.push_back(dir);
+    }
+    return dirs;
+}
+
+bool starts_with(const std::string& s, const std::string& prefix) {
+    return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+} // namespace
+
+completion_index::~completion_index() {
+    stop();
+}
+
+void completion_index::start(const std::vector<std::string>& builtins) {
+    {
+        std::unique_lock lock(names_mtx);
+        for (const auto& b : builtins) {
+            auto it = std::lower_bound(names.begin(), names.end(), b,
+                                       [](const name_entry& e, const std::string& n) { return e.name < n; });
+            if (it == names.end() || it->name != b) names.insert(it, {b, 1});
+        }
+    }
+    if (pipe2(stop_pipe, O_CLOEXEC) == -1) {
+        perror("completion: pipe failed");
+        return;
+    }
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    // Signals such as SIGCHLD must keep going to the shell's main thread.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    watcher = std::thread(&completion_index::watch_path, this);
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+void completion_index::stop() {
+    if (watcher.joinable()) {
+        char c = 0;
+        if (write(stop_pipe[1], &c, 1) == -1) perror("completion: stop failed");
+        watcher.join();
+    }
+    for (int* fd : {&inotify_fd, &stop_pipe[0], &stop_pipe[1]}) {
+        if (*fd != -1) close(*fd);
+        *fd = -1;
+    }
+}
+
+void completion_index::add_name(const std::string& name) {
+    std::unique_lock lock(names_mtx);
+    auto it = std::lower_bound(names.begin(), names.end(), name,
+                               [](const name_entry& e, const std::string& n) { return e.name < n; });
+    if (it != names.end() && it->name == name) ++it->refs;
+    else names.insert(it, {name, 1});
+}
+
+void completion_index::remove_name(const std::string& name) {
+    std::unique_lock lock(names_mtx);
+    auto it = std::lower_bound(names.begin(), names.end(), name,
+                               [](const name_entry& e, const std::string& n) { return e.name < n; });
+    if (it == names.end() || it->name != name) return;
+    if (--it->refs == 0) names.erase(it);
+}
+
+void completion_index::scan_dir(const std::string& dir) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+    auto& execs = dir_execs[dir];
+    std::vector<std::string> found;
+    while (dirent* ent = readdir(d)) {
+        if (ent->d_name[0] == '.') continue;
+        if (ent->d_type == DT_DIR) continue;
+        std::string name = ent->d_name;
+        if (execs.count(name) || !is_executable(dir + "/" + name)) continue;
+        execs.insert(name);
+        found.push_back(std::move(name));
+    }
+    closedir(d);
+
+    // Merge the whole directory at once instead of one insert per name.
+    std::sort(found.begin(), found.end());
+    std::unique_lock lock(names_mtx);
+    std::vector<name_entry> merged;
+    merged.reserve(names.size() + found.size());
+    auto it = names.begin();
+    for (auto& name : found) {
+        while (it != names.end() && it->name < name) merged.push_back(std::move(*it++));
+        if (it != names.end() && it->name == name) {
+            merged.push_back({std::move(it->name), it->refs + 1});
+            ++it;
+        } else {
+            merged.push_back({std::move(name), 1});
+        }
+    }
+    std::move(it, names.end(), std::back_inserter(merged));
+    names = std::move(merged);
+}
+
+void completion_index::watch_path() {
+    auto dirs = path_dirs();
+    // Watches go in before the scan, so nothing created in between is missed.
+    for (const auto& dir : dirs) {
+        if (inotify_fd == -1) break;
+        int wd = inotify_add_watch(inotify_fd, dir.c_str(), watch_mask);
+        if (wd != -1) watched_dirs[wd] = dir;
+    }
+    for (const auto& dir : dirs) {
+        scan_dir(dir);
+    }
+    if (inotify_fd == -1) return;
+
+    alignas(inotify_event) char buffer[16 * 1024];
+    pollfd fds[2] = {{stop_pipe[0], POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (fds[0].revents) return;
+
+        ssize_t len;
+        while ((len = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+            for (char* p = buffer; p < buffer + len; ) {
+                auto* ev = reinterpret_cast<inotify_event*>(p);
+                p += sizeof(inotify_event) + ev->len;
+
+                auto wd_it = watched_dirs.find(ev->wd);
+                if (wd_it == watched_dirs.end()) continue;
+                const std::string& dir = wd_it->second;
+                auto& execs = dir_execs[dir];
+
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    for (const auto& name : execs) remove_name(name);
+                    dir_execs.erase(dir);
+                    watched_dirs.erase(wd_it);
+                    continue;
+                }
+                if (ev->len == 0 || (ev->mask & IN_ISDIR)) continue;
+
+                std::string name = ev->name;
+                bool known = execs.count(name) != 0;
+                bool present = !(ev->mask & (IN_DELETE | IN_MOVED_FROM)) &&
+                               is_executable(dir + "/" + name);
+                if (present && !known) {
+                    execs.insert(name);
+                    add_name(name);
+                } else if (!present && known) {
+                    execs.erase(name);
+                    remove_name(name);
+                }
+            }
+        }
+    }
+}
+
+std::vector<std::string> completion_index::commands_with_prefix(const std::string& prefix) const {
+    std::vector<std::string> res;
+    std::shared_lock lock(names_mtx);
+    auto it = std::lower_bound(names.begin(), names.end(), prefix,
+                               [](const name_entry& e, const std::string& n) { return e.name < n; });
+    for (; it != names.end() && starts_with(it->name, prefix); ++it) {
+        res.push_back(it->name);
+    }
+    return res;
+}
+
+const completion_index::dir_listing* completion_index::listing_for(const std::string& dir) {
+    struct stat st{};
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        listing_cache.erase(dir);
+        return nullptr;
+    }
+    auto it = listing_cache.find(dir);
+    if (it != listing_cache.end() &&
+        it->second.mtime.tv_sec == st.st_mtim.tv_sec && it->second.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        return &it->second;
+    }
+
+    DIR* d = opendir(dir.c_str());
+    if (!d) return nullptr;
+    dir_listing listing;
+    listing.mtime = st.st_mtim;
+    while (dirent* ent = readdir(d)) {
+        std::string name = ent->d_name;
+        if (name == "." || name == "..") continue;
+        bool is_dir = ent->d_type == DT_DIR;
+        if (ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) {
+            struct stat est{};
+            is_dir = stat((dir + "/" + name).c_str(), &est) == 0 && S_ISDIR(est.st_mode);
+        }
+        if (is_dir) name += '/';
+        listing.names.push_back(std::move(name));
+    }
+    closedir(d);
+    std::sort(listing.names.begin(), listing.names.end());
+    return &(listing_cache[dir] = std::move(listing));
+}
+
+std::vector<std::string> completion_index::paths_with_prefix(const std::string& text) {
+    std::vector<std::string> res;
+    size_t slash = text.rfind('/');
+    std::string dir_part = slash == std::string::npos ? "" : text.substr(0, slash + 1);
+    std::string base = slash == std::string::npos ? text : text.substr(slash + 1);
+
+    std::string lookup = dir_part.empty() ? "." : dir_part;
+    if (lookup[0] == '~') {
+        const char* home = std::getenv("HOME");
+        if (home) lookup.replace(0, 1, home);
+    }
+
+    const dir_listing* listing = listing_for(lookup);
+    if (!listing) return res;
+    auto it = std::lower_bound(listing->names.begin(), listing->names.end(), base);
+    for (; it != listing->names.end() && starts_with(*it, base); ++it) {
+        if ((*it)[0] == '.' && (base.empty() || base[0] != '.')) continue;
+        res.push_back(dir_part + *it);
+    }
+    return res;
+}
+
+namespace {
+
+completion_index* active_index = nullptr;
+std::unordered_map<std::string, std::vector<std::string>> prefix_commands;
+std::vector<std::string> pending_matches;
+
+char* match_generator(const char*, int state) {
+    static size_t next;
+    if (state == 0) next = 0;
+    if (next >= pending_matches.size()) return nullptr;
+    return strdup(pending_matches[next++].c_str());
+}
+
+bool is_prefix_value_opt(const std::string& cmd, const std::string& opt) {
+    const auto& opts = prefix_commands.at(cmd);
+    return std::find(opts.begin(), opts.end(), opt) != opts.end();
+}
+
+//! True if the word at start names a command: it begins the line or a
+//  pipeline stage, or follows a prefix builtin and that builtin's options.
+bool is_command_position(int start) {
+    int seg = start;
+    while (seg > 0 && rl_line_buffer[seg - 1] != '|' && rl_line_buffer[seg - 1] != '(') --seg;
+
+    std::vector<std::string> words;
+    std::istringstream in(std::string(rl_line_buffer + seg, start - seg));
+    for (std::string word; in >> word; ) words.push_back(word);
+
+    size_t pos = 0;
+    while (pos < words.size()) {
+        if (prefix_commands.find(words[pos]) == prefix_commands.end()) return false;
+        const std::string& cmd = words[pos++];
+        while (pos < words.size() && words[pos].size() > 1 && words[pos][0] == '-') {
+            if (words[pos] == "--") {
+                ++pos;
+                break;
+            }
+            pos += is_prefix_value_opt(cmd, words[pos]) ? 2 : 1;
+        }
+    }
+    return pos == words.size();
+}
+
+char** attempted_completion(const char* text, int start, int) {
+    rl_attempted_completion_over = 1;
+    if (!active_index) return nullptr;
+
+    std::string prefix = text;
+    if (is_command_position(start) && prefix.find('/') == std::string::npos) {
+        pending_matches = active_index->commands_with_prefix(prefix);
+    } else {
+        pending_matches = active_index->paths_with_prefix(prefix);
+        if (pending_matches.size() == 1 && pending_matches[0].back() == '/') {
+            rl_completion_suppress_append = 1;
+        }
+    }
+    return rl_completion_matches(text, match_generator);
+}
+
+} // namespace
+
+void install_readline_completion(completion_index& index,
+                                 const std::unordered_map<std::string, std::vector<std::string>>& prefix_cmds) {
+    active_index = &index;
+    prefix_commands = prefix_cmds;
+    rl_attempted_completion_function = attempted_completion;
+}
@@ -0,0 +1,66 @@
+#ifndef MYSHELL_COMPLETION_H
+#define MYSHELL_COMPLETION_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <shared_mutex>
+#include <thread>
+#include <ctime>
+
+//! Prefix index of builtin names and PATH executables.
+//  Names are kept in a sorted array, so a prefix lookup is one binary search
+//  plus a linear walk over the matches. The array is filled in a background
+//  thread at startup and then kept up to date with inotify.
+class completion_index {
+public:
+    completion_index() = default;
+    completion_index(const completion_index&) = delete;
+    completion_index& operator=(const completion_index&) = delete;
+    ~completion_index();
+
+    void start(const std::vector<std::string>& builtins);
+    void stop();
+
+    [[nodiscard]] std::vector<std::string> commands_with_prefix(const std::string& prefix) const;
+    [[nodiscard]] std::vector<std::string> paths_with_prefix(const std::string& text);
+
+private:
+    struct name_entry {
+        std::string name;
+        unsigned refs;
+    };
+    struct dir_listing {
+        timespec mtime{};
+        std::vector<std::string> names;   // sorted, directories end with '/'
+    };
+
+    void watch_path();
+    void scan_dir(const std::string& dir);
+    void add_name(const std::string& name);
+    void remove_name(const std::string& name);
+    const dir_listing* listing_for(const std::string& dir);
+
+    mutable std::shared_mutex names_mtx;
+    std::vector<name_entry> names;
+
+    // Only touched by the watcher thread.
+    std::unordered_map<int, std::string> watched_dirs;
+    std::unordered_map<std::string, std::unordered_set<std::string>> dir_execs;
+
+    // Only touched by the readline (main) thread.
+    std::unordered_map<std::string, dir_listing> listing_cache;
+
+    std::thread watcher;
+    int inotify_fd = -1;
+    int stop_pipe[2] = {-1, -1};
+};
+
+//! Makes readline complete commands and paths from the given index.
+//  prefix_cmds maps each prefix builtin (mtime, mcache, ...) to its options
+//  that take a value, so the command it wraps is completed as a command.
+void install_readline_completion(completion_index& index,
+                                 const std::unordered_map<std::string, std::vector<std::string>>& prefix_cmds);
+
+#endif //MYSHELL_COMPLETION_H
@@ -0,0 +1,199 @@
+#include "history_log.h"
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+// Entries are single lines on disk: '\n' and '\\' are escaped.
+std::string escape(const std::string& entry) {
+    std::string res;
+    res.reserve(entry.size() + 1);
+    for (char c : entry) {
+        if (c == '\\') res += "\\\\";
+        else if (c == '\n') res += "\\n";
+        else res += c;
+    }
+    return res;
+}
+
+std::string unescape(std::string_view line) {
+    std::string res;
+    res.reserve(line.size());
+    for (size_t i = 0; i < line.size(); ++i) {
+        if (line[i] == '\\' && i + 1 < line.size()) {
+            ++i;
+            res += line[i] == 'n' ? '\n' : line[i];
+        } else {
+            res += line[i];
+        }
+    }
+    return res;
+}
+
+bool same_file(int fd, const std::string& path) {
+    struct stat by_fd{}, by_path{};
+    return fstat(fd, &by_fd) == 0 && stat(path.c_str(), &by_path) == 0 &&
+           by_fd.st_dev == by_path.st_dev && by_fd.st_ino == by_path.st_ino;
+}
+
+} // namespace
+
+history_log::history_log(std::string path) : path(std::move(path)) {}
+
+history_log::~history_log() {
+    if (compactor.joinable()) compactor.join();
+    unmap();
+    if (append_fd != -1) close(append_fd);
+}
+
+std::string history_log::default_path() {
+    if (const char* file = std::getenv("MSHELL_HISTFILE")) return file;
+    const char* home = std::getenv("HOME");
+    return std::string(home ? home : ".") + "/.mshell_history";
+}
+
+uint64_t history_log::default_limit() {
+    if (const char* size = std::getenv("MSHELL_HISTFILESIZE")) {
+        char* end;
+        unsigned long long mib = strtoull(size, &end, 10);
+        if (end != size && mib > 0) return mib * 1024 * 1024;
+    }
+    return 64ULL * 1024 * 1024;
+}
+
+bool history_log::open() {
+    append_fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (append_fd == -1) return false;
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            map = static_cast<const char*>(p);
+            map_size = st.st_size;
+            scan_pos = map_size;
+        }
+    }
+    if (fd != -1) close(fd);
+    return true;
+}
+
+void history_log::unmap() {
+    if (map) munmap(const_cast<char*>(map), map_size);
+    map = nullptr;
+    map_size = 0;
+    scan_pos = 0;
+    index.clear();
+}
+
+std::string_view history_log::entry_from_end(size_t i) {
+    while (index.size() <= i && scan_pos > 0) {
+        size_t end = scan_pos;
+        // The newline ends the entry; a torn last line is still an entry.
+        size_t text_end = map[end - 1] == '\n' ? end - 1 : end;
+        const void* nl = text_end > 0 ? memrchr(map, '\n', text_end) : nullptr;
+        size_t begin = nl ? static_cast<const char*>(nl) - map + 1 : 0;
+        scan_pos = begin;
+        if (text_end > begin) index.emplace_back(begin, text_end);
+    }
+    if (i >= index.size()) return {};
+    return {map + index[i].first, index[i].second - index[i].first};
+}
+
+void history_log::load_recent(size_t count, const std::function<void(const std::string&)>& add) {
+    size_t available = 0;
+    while (available < count && !entry_from_end(available).empty()) {
+        ++available;
+    }
+    for (size_t i = available; i-- > 0; ) {
+        add(unescape(entry_from_end(i)));
+    }
+}
+
+void history_log::append(const std::string& entry) {
+    if (append_fd == -1) return;
+    std::string record = escape(entry) + '\n';
+
+    // Shared lock: appends from many shells may interleave, but never with
+    // a compaction, which takes the lock exclusively and then replaces the
+    // file. An fd still pointing at the replaced file is reopened.
+    flock(append_fd, LOCK_SH);
+    if (!same_file(append_fd, path)) {
+        flock(append_fd, LOCK_UN);
+        close(append_fd);
+        append_fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (append_fd == -1) return;
+        flock(append_fd, LOCK_SH);
+    }
+    bool written = write(append_fd, record.data(), record.size()) == static_cast<ssize_t>(record.size());
+    struct stat st{};
+    bool too_big = fstat(append_fd, &st) == 0 && static_cast<uint64_t>(st.st_size) > default_limit();
+    flock(append_fd, LOCK_UN);
+    if (!written) perror("history: append failed");
+
+    if (too_big && !compacting.exchange(true)) {
+        if (compactor.joinable()) compactor.join();
+        // The worker must not take the shell's signals (SIGCHLD in particular).
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        compactor = std::thread(&history_log::compact, this);
+        compactor_owner = getpid();
+        pthread_sigmask(SIG_SETMASK, &old, nullptr);
+    }
+}
+
+void history_log::finish() {
+    if (compactor.joinable() && compactor_owner == getpid()) compactor.join();
+}
+
+void history_log::compact() {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        compacting = false;
+        return;
+    }
+    flock(fd, LOCK_EX);
+    struct stat st{};
+    uint64_t limit = default_limit();
+    // Another shell may have compacted the log while we waited for the lock.
+    if (!same_file(fd, path) || fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) <= limit) {
+        close(fd);
+        compacting = false;
+        return;
+    }
+
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+        const char* data = static_cast<const char*>(p);
+        size_t size = st.st_size;
+        // Keep the newest half of the limit, starting at an entry boundary.
+        size_t cut = size - limit / 2;
+        const void* nl = memchr(data + cut, '\n', size - cut);
+        cut = nl ? static_cast<const char*>(nl) - data + 1 : size;
+
+        std::string tmp = path + ".compact." + std::to_string(getpid());
+        int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        bool ok = out != -1;
+        for (size_t done = cut; ok && done < size; ) {
+            ssize_t n = write(out, data + done, size - done);
+            ok = n > 0;
+            if (ok) done += n;
+        }
+        ok = ok && fsync(out) == 0;
+        if (out != -1) close(out);
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+        munmap(p, size);
+    }
+    close(fd);
+    compacting = false;
+}
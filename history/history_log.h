@@ -0,0 +1,61 @@
+#ifndef MYSHELL_HISTORY_LOG_H
+#define MYSHELL_HISTORY_LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+
+//! Command history kept as an append-only log, one entry per line.
+//  Each entry is appended with a single O_APPEND write, so concurrent
+//  shells can share the log. At startup the log is mmap'ed and indexed
+//  from the end only as far as needed, so startup cost does not depend
+//  on the length of the history. When the log outgrows its size limit,
+//  a background thread rewrites it with only the newest half.
+class history_log {
+public:
+    explicit history_log(std::string path = default_path());
+    history_log(const history_log&) = delete;
+    history_log& operator=(const history_log&) = delete;
+    ~history_log();
+
+    //! $MSHELL_HISTFILE, else ~/.mshell_history.
+    static std::string default_path();
+    //! $MSHELL_HISTFILESIZE in MiB, 64 by default.
+    static uint64_t default_limit();
+
+    bool open();
+    //! Passes the newest count entries to add, oldest first.
+    void load_recent(size_t count, const std::function<void(const std::string&)>& add);
+    void append(const std::string& entry);
+    //! Waits for a background compaction, so that exit() does not cut it
+    //  short and leave its temporary file next to the log. Does nothing in
+    //  a forked child, which does not have the thread.
+    void finish();
+
+private:
+    //! Entry i counting back from the newest one in the startup snapshot;
+    //  empty once the beginning of the log is reached.
+    std::string_view entry_from_end(size_t i);
+    void compact();
+    void unmap();
+
+    std::string path;
+    int append_fd = -1;
+    const char* map = nullptr;
+    size_t map_size = 0;
+    // [begin, end) of indexed entries, newest first; map[0, scan_pos) is not indexed yet.
+    std::vector<std::pair<size_t, size_t>> index;
+    size_t scan_pos = 0;
+
+    std::thread compactor;
+    pid_t compactor_owner = -1;
+    std::atomic<bool> compacting{false};
+};
+
+#endif //MYSHELL_HISTORY_LOG_H
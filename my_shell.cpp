@@ -10,7 +10,124 @@ static void zombie_handler(int) {
     }
 }
 
+namespace {
+
+//! Options of the prefix builtins that take a value; the wrapped command
+//  starts after the last option. Also used for completion.
+const std::unordered_map<std::string, std::vector<std::string>> prefix_value_opts = {
+    {"mtaskset", {"-c", "--cpus", "-n", "--node"}},
+    {"mbatch", {"-P", "--jobs", "-n", "--max-args"}},
+    {"mcache", {"-i", "--input", "-e", "--env"}},
+    {"mtime", {}},
+};
+
+//! Blocks SIGCHLD while alive, so zombie_handler cannot reap a child
+//  before we collect its status ourselves.
+class sigchld_guard {
+public:
+    sigchld_guard() {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &set, &old_mask);
+    }
+    sigchld_guard(const sigchld_guard&) = delete;
+    sigchld_guard& operator=(const sigchld_guard&) = delete;
+    ~sigchld_guard() { restore(); }
+
+    //! Also used right after fork(), so the child does not exec with SIGCHLD blocked.
+    void restore() const { sigprocmask(SIG_SETMASK, &old_mask, nullptr); }
+
+private:
+    sigset_t old_mask{};
+};
+
+bool write_all(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        written += n;
+    }
+    return true;
+}
+
+std::string read_all(int fd) {
+    std::string data;
+    char buffer[64 * 1024];
+    ssize_t n;
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        data.append(buffer, n);
+    }
+    return data;
+}
+
+uint64_t elapsed_us(std::chrono::steady_clock::time_point start) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+double timeval_s(const timeval& tv) {
+    return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1e6;
+}
+
+size_t arg_cost(const std::string& arg) {
+    return arg.size() + 1 + sizeof(char*);
+}
+
+//! Bytes execve() leaves for argv: ARG_MAX minus the environment and the
+//  same 2 KiB of headroom xargs keeps.
+size_t arg_space() {
+    long arg_max = sysconf(_SC_ARG_MAX);
+    if (arg_max <= 0) arg_max = 128 * 1024;
+    size_t used = 2048 + sizeof(char*);
+    for (char** env = environ; *env; ++env) {
+        used += strlen(*env) + 1 + sizeof(char*);
+    }
+    return static_cast<size_t>(arg_max) > used ? static_cast<size_t>(arg_max) - used : 0;
+}
+
+//! xargs-style split: every batch takes as many of args[begin, end) as
+//  fit into space (and max_args, if set), and repeats the words before
+//  and after that range, like xargs -I. Returns false if even one
+//  argument cannot fit.
+bool split_arg_batches(const std::vector<std::string>& args, size_t begin, size_t end, size_t space,
+                       size_t max_args, std::vector<std::vector<std::string>>& batches) {
+    size_t fixed_cost = 0;
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (i < begin || i >= end) fixed_cost += arg_cost(args[i]);
+    }
+    auto flush = [&](std::vector<std::string>& batch) {
+        batch.insert(batch.end(), args.begin() + end, args.end());
+        batches.push_back(std::move(batch));
+        batch.assign(args.begin(), args.begin() + begin);
+    };
+
+    std::vector<std::string> batch(args.begin(), args.begin() + begin);
+    size_t cost = fixed_cost;
+    for (size_t i = begin; i < end; ++i) {
+        if (fixed_cost + arg_cost(args[i]) > space) return false;
+        bool full = cost + arg_cost(args[i]) > space || (max_args && batch.size() - begin == max_args);
+        if (full) {
+            flush(batch);
+            cost = fixed_cost;
+        }
+        batch.push_back(args[i]);
+        cost += arg_cost(args[i]);
+    }
+    flush(batch);
+    return true;
+}
+
+} // namespace
+
 void my_shell::restore_redirection(const Redirection& redir) {
+    if (redir.stdin_redirected) {
+        dup2(redir.stdin_backup, STDIN_FILENO);
+        close(redir.stdin_backup);
+    }
     if (redir.stdout_redirected) {
         dup2(redir.stdout_backup, STDOUT_FILENO);
         close(redir.stdout_backup);
@@ -21,18 +138,46 @@ void my_shell::restore_redirection(const Redirection& redir) {
     }
 }
 
+int my_shell::open_redirect_target(const std::string& rest, const char* open_error) {
+    size_t start = rest.find_first_not_of(" \t");
+    if (start == std::string::npos) {
+        std::cerr << "Error: missing redirection target" << std::endl;
+        return -1;
+    }
+    std::string file;
+    if ((rest[start] == '>' || rest[start] == '<') && rest.compare(start + 1, 1, "(") == 0) {
+        int depth = 1;
+        size_t end = start + 2;
+        for (; end < rest.size() && depth > 0; ++end) {
+            if (rest[end] == '(') ++depth;
+            else if (rest[end] == ')') --depth;
+        }
+        if (depth > 0) {
+            std::cerr << "Error: unterminated process substitution in redirection" << std::endl;
+            return -1;
+        }
+        file = launch_process_substitution(rest.substr(start + 2, end - start - 3), rest[start] == '<');
+    } else {
+        file = rest.substr(start, rest.find_first_of(" \t", start) - start);
+        if (file.find_first_of("<>()") != std::string::npos) {
+            std::cerr << "Error: invalid redirection target " << file << std::endl;
+            return -1;
+        }
+    }
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) perror(open_error);
+    return fd;
+}
+
 Redirection my_shell::handle_redirection(std::string& line) {
     Redirection redir;
     std::string tmp_line = line;
     size_t pos;
-    if ((pos = line.find(">")) != std::string::npos) {
-        std::string file = line.substr(pos + 1);
+    if ((pos = find_redirect(line, ">")) != std::string::npos) {
         tmp_line = line.substr(0, pos);
-        file.erase(0, file.find_first_not_of(" \t"));
-        file = file.substr(0, file.find_first_of(" \t"));
-        int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        int fd = open_redirect_target(line.substr(pos + 1), "Failed to open file for stdout redirection");
         if (fd < 0) {
-            perror("Failed to open file for stdout redirection");
+            line.clear();
             return redir;
         }
         if (line.find("2>&1") != std::string::npos) {
@@ -46,15 +191,11 @@ Redirection my_shell::handle_redirection(std::string& line) {
         close(fd);
         redirecting = true;
     }
-    if ((pos = line.find("2>")) != std::string::npos && line.find("2>&1", pos) == std::string::npos) {
-        restore_redirection(redir);
-        std::string file = line.substr(pos + 2);
-        tmp_line = line.substr(0, pos);
-        file.erase(0, file.find_first_not_of(" \t")); 
-        file = file.substr(0, file.find_first_of(" \t"));
-        int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((pos = find_redirect(line, "2>")) != std::string::npos && line.find("2>&1", pos) == std::string::npos) {
+        tmp_line = line.substr(0, std::min(pos, tmp_line.size()));
+        int fd = open_redirect_target(line.substr(pos + 2), "Failed to open file for stderr redirection");
         if (fd < 0) {
-            perror("Failed to open file for stderr redirection");
+            line.clear();
             return redir;
         }
         redir.stderr_backup = dup(STDERR_FILENO);
@@ -64,15 +205,12 @@ Redirection my_shell::handle_redirection(std::string& line) {
         redirecting = true;
 
     }
-    if ((pos = line.find("&>")) != std::string::npos) {
+    if ((pos = find_redirect(line, "&>")) != std::string::npos) {
         restore_redirection(redir);
-        std::string file = line.substr(pos + 2);
-        tmp_line = line.substr(0, pos);
-        file.erase(0, file.find_first_not_of(" \t"));
-        file = file.substr(0, file.find_first_of(" \t"));
-        int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        tmp_line = line.substr(0, std::min(pos, tmp_line.size()));
+        int fd = open_redirect_target(line.substr(pos + 2), "Failed to open file for combined redirection");
         if (fd < 0) {
-            perror("Failed to open file for combined redirection");
+            line.clear();
             return redir;
         }
         redir.stdout_backup = dup(STDOUT_FILENO);
@@ -91,6 +229,156 @@ Redirection my_shell::handle_redirection(std::string& line) {
 
 
 
+std::string my_shell::expand_vars(const std::string& text) {
+    std::string res;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '\\' && i + 1 < text.size() && text[i + 1] == '$') {
+            res += '$';
+            ++i;
+            continue;
+        }
+        if (text[i] != '$' || i + 1 == text.size()) {
+            res += text[i];
+            continue;
+        }
+        if (text[i + 1] == '?') {
+            res += std::to_string(last_status);
+            ++i;
+            continue;
+        }
+        size_t start = i + 1;
+        size_t end;
+        if (text[start] == '{') {
+            end = text.find('}', start);
+            if (end == std::string::npos) {
+                res += text[i];
+                continue;
+            }
+            const char* value = std::getenv(text.substr(start + 1, end - start - 1).c_str());
+            if (value) res += value;
+            i = end;
+            continue;
+        }
+        end = start;
+        while (end < text.size() && (std::isalnum(static_cast<unsigned char>(text[end])) || text[end] == '_')) {
+            ++end;
+        }
+        if (end == start) {
+            res += text[i];
+            continue;
+        }
+        const char* value = std::getenv(text.substr(start, end - start).c_str());
+        if (value) res += value;
+        i = end - 1;
+    }
+    return res;
+}
+
+std::optional<std::string> my_shell::extract_here_input(std::string& line,
+                                                        const std::function<bool(std::string&)>& next_line) {
+    size_t pos = line.find("<<");
+    if (pos == std::string::npos) return std::nullopt;
+
+    if (line.compare(pos, 3, "<<<") == 0) {
+        size_t start = line.find_first_not_of(" \t", pos + 3);
+        if (start == std::string::npos) {
+            line.erase(pos);
+            return "\n";
+        }
+        std::string word;
+        size_t end;
+        char quote = line[start];
+        if (quote == '"' || quote == '\'') {
+            end = line.find(quote, start + 1);
+            if (end == std::string::npos) end = line.size();
+            word = line.substr(start + 1, end - start - 1);
+            if (quote == '"') word = expand_vars(word);
+            end = std::min(end + 1, line.size());
+        } else {
+            end = line.find_first_of(" \t|", start);
+            if (end == std::string::npos) end = line.size();
+            word = expand_vars(line.substr(start, end - start));
+        }
+        line.erase(pos, end - pos);
+        return word + "\n";
+    }
+
+    bool strip_tabs = line.compare(pos, 3, "<<-") == 0;
+    size_t start = line.find_first_not_of(" \t", pos + (strip_tabs ? 3 : 2));
+    if (start == std::string::npos) {
+        line.erase(pos);
+        return "";
+    }
+    size_t end = line.find_first_of(" \t|", start);
+    if (end == std::string::npos) end = line.size();
+    std::string delim = line.substr(start, end - start);
+    line.erase(pos, end - pos);
+
+    // A quoted delimiter (<<'EOF') keeps the body literal, as in sh.
+    bool quoted = delim.find_first_of("'\"") != std::string::npos;
+    delim.erase(std::remove_if(delim.begin(), delim.end(), [](char c) { return c == '\'' || c == '"'; }),
+                delim.end());
+
+    std::string body;
+    std::string body_line;
+    bool terminated = false;
+    while (next_line(body_line)) {
+        if (strip_tabs) body_line.erase(0, body_line.find_first_not_of('\t'));
+        if (body_line == delim) {
+            terminated = true;
+            break;
+        }
+        body += body_line + "\n";
+    }
+    if (!terminated) {
+        std::cerr << "Warning: here-document delimited by end-of-file (wanted '" << delim << "')" << std::endl;
+    }
+    return quoted ? body : expand_vars(body);
+}
+
+int my_shell::here_input_fd(const std::string& body) {
+    int fd = -1;
+    // A write of up to PIPE_BUF bytes into an empty pipe never blocks, so
+    // small bodies skip the memfd and go through a pipe.
+    if (body.size() <= PIPE_BUF) {
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == 0) {
+            if (write(pipefd[1], body.data(), body.size()) == static_cast<ssize_t>(body.size())) {
+                fd = pipefd[0];
+            } else {
+                close(pipefd[0]);
+            }
+            close(pipefd[1]);
+        }
+    } else {
+        fd = memfd_create("mshell-here-doc", MFD_CLOEXEC);
+        size_t written = 0;
+        while (fd != -1 && written < body.size()) {
+            ssize_t n = write(fd, body.data() + written, body.size() - written);
+            if (n <= 0) {
+                close(fd);
+                fd = -1;
+            } else {
+                written += n;
+            }
+        }
+        if (fd != -1) lseek(fd, 0, SEEK_SET);
+    }
+    if (fd == -1) perror("Failed to create here-document input");
+    return fd;
+}
+
+void my_shell::redirect_stdin(Redirection& redir, const std::string& body) {
+    int fd = here_input_fd(body);
+    if (fd == -1) return;
+    redir.stdin_backup = dup(STDIN_FILENO);
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+    redir.stdin_redirected = true;
+    redir.stdin_data = body;
+    redirecting = true;
+}
+
 my_shell::my_shell(int argc, char** argv)
 {
     if (argc > 1) {
@@ -137,9 +425,45 @@ my_shell::my_shell(int argc, char** argv)
     };
     internal_cmds_m["mexport"] = mexport_f;
 
+    auto mtaskset_f = [&](const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir) {
+        mtaskset(args, input_file, redir);
+    };
+    prefix_cmds_m["mtaskset"] = mtaskset_f;
+
+    auto mcache_f = [&](const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir) {
+        mcache(args, input_file, redir);
+    };
+    prefix_cmds_m["mcache"] = mcache_f;
+
+    auto mbatch_f = [&](const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir) {
+        mbatch(args, input_file, redir);
+    };
+    prefix_cmds_m["mbatch"] = mbatch_f;
+
+    auto mtime_f = [&](const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir) {
+        mtime(args, input_file, redir);
+    };
+    prefix_cmds_m["mtime"] = mtime_f;
+
+    auto mstats_f = [&](const std::vector<std::string>& args, const Redirection& redir) {
+        mstats(args, redir);
+    };
+    internal_cmds_m["mstats"] = mstats_f;
+
     std::string old_path = std::getenv("PATH");
     std::string cwd = std::filesystem::canonical("/proc/self/exe").parent_path().string();
     setenv("PATH", (cwd + ":" + old_path).c_str(), 1);
+
+    std::vector<std::string> builtins;
+    for (const auto& [name, f] : internal_cmds_m) {
+        builtins.push_back(name);
+    }
+    for (const auto& [name, f] : prefix_cmds_m) {
+        builtins.push_back(name);
+    }
+    completion.start(builtins);
+    install_readline_completion(completion, prefix_value_opts);
+
     if (signal(SIGCHLD, zombie_handler) == SIG_ERR) {
         perror("signal setup failed");
         exit(EXIT_FAILURE);
@@ -169,6 +493,10 @@ bool my_shell::parse_args(const std::vector<std::string>& args,
         std::cerr << "Error: Unknown option '" << e.get_option_name() << "'" << std::endl;
         last_status = ERROR::UknownOption;
         return false;  
+    } catch (const po::error& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        last_status = ERROR::Other;
+        return false;
     }
 
     if (vm.count("help")) {
@@ -301,6 +629,7 @@ void my_shell::mexit(const std::vector<std::string> &args, const Redirection& re
     if (vm.count("help")) {
         show_help(mexit_desc);
     } else {
+        history.finish();
         exit(exit_status);
     }
 }
@@ -425,6 +754,402 @@ void my_shell::mexport(const std::vector<std::string>& args, const Redirection&
 }
 
 
+size_t my_shell::prefix_cmd_start(const std::vector<std::string>& args) {
+    const auto& value_opts = prefix_value_opts.at(args[0]);
+    size_t pos = 1;
+    while (pos < args.size() && args[pos].size() > 1 && args[pos][0] == '-') {
+        if (args[pos] == "--") return pos + 1;
+        bool takes_value = std::find(value_opts.begin(), value_opts.end(), args[pos]) != value_opts.end();
+        pos += takes_value ? 2 : 1;
+    }
+    return std::min(pos, args.size());
+}
+
+void my_shell::mtaskset(const std::vector<std::string>& args, const std::string& input_file,
+                        const Redirection& redir) {
+    int stderr_fd = redir.stderr_fd;
+    size_t cmd_start = prefix_cmd_start(args);
+    std::vector<std::string> own_args(args.begin(), args.begin() + cmd_start);
+    if (!own_args.empty() && own_args.back() == "--") own_args.pop_back();
+
+    std::string cpu_list;
+    int node = -1;
+    po::variables_map vm;
+    po::options_description mtaskset_desc("mtaskset options");
+    mtaskset_desc.add_options()
+        ("help,h", "Run a command on a CPU set or NUMA node: mtaskset (-c LIST | -n NODE) command [args]")
+        ("cpus,c", po::value<std::string>(&cpu_list), "CPU list, e.g. 0-3,8")
+        ("node,n", po::value<int>(&node), "NUMA node; also prefers its memory");
+
+    if (!parse_args(own_args, mtaskset_desc, vm)) return;
+    if (cmd_start >= args.size()) {
+        dprintf(stderr_fd, "Error: Too few arguments\n");
+        last_status = ERROR::WrongArgCount;
+        return;
+    }
+    if (vm.count("cpus") == vm.count("node")) {
+        dprintf(stderr_fd, "Error: Exactly one of --cpus or --node is required\n");
+        last_status = ERROR::WrongArgCount;
+        return;
+    }
+
+    std::vector<int> cpus;
+    if (vm.count("cpus")) {
+        if (!parse_cpu_list(cpu_list, cpus)) {
+            dprintf(stderr_fd, "Error: Invalid CPU list %s\n", cpu_list.c_str());
+            last_status = ERROR::Other;
+            return;
+        }
+    } else {
+        cpus = topology.node_cpus(node);
+    }
+    if (cpus.empty()) {
+        dprintf(stderr_fd, "Error: No CPUs selected\n");
+        last_status = ERROR::Other;
+        return;
+    }
+
+    // The shell thread is pinned for the duration of the command: forked
+    // children inherit both the CPU mask and the memory policy.
+    cpu_set_t saved_mask;
+    sched_getaffinity(0, sizeof(saved_mask), &saved_mask);
+    if (!pin_to_cpus(cpus)) {
+        dprintf(stderr_fd, "Error: Cannot set CPU affinity: %s\n", strerror(errno));
+        last_status = ERROR::Other;
+        return;
+    }
+    int saved_policy = MPOL_DEFAULT;
+    unsigned long saved_nodes = 0;
+    bool policy_set = false;
+    if (node >= 0 && node < static_cast<int>(sizeof(unsigned long) * 8)) {
+        unsigned long nodes = 1UL << node;
+        syscall(SYS_get_mempolicy, &saved_policy, &saved_nodes, sizeof(saved_nodes) * 8, nullptr, 0);
+        policy_set = syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodes, sizeof(nodes) * 8) == 0;
+    }
+
+    std::vector<std::string> cmd(args.begin() + cmd_start, args.end());
+    run_command(cmd, input_file, redir);
+
+    if (policy_set) {
+        syscall(SYS_set_mempolicy, saved_policy, saved_policy == MPOL_DEFAULT ? nullptr : &saved_nodes,
+                sizeof(saved_nodes) * 8);
+    }
+    sched_setaffinity(0, sizeof(saved_mask), &saved_mask);
+}
+
+void my_shell::exec_command(const std::vector<std::string>& cmd, const std::string& input_file) {
+    if (prefix_cmds_m.count(cmd[0]) || internal_cmds_m.count(cmd[0])) {
+        run_command(cmd, input_file, Redirection{});
+        exit(last_status);
+    }
+    if (!input_file.empty()) {
+        int input_fd = open(input_file.c_str(), O_RDONLY);
+        if (input_fd == -1 || dup2(input_fd, STDIN_FILENO) == -1) {
+            perror("Cannot open file for input");
+            exit(1);
+        }
+        close(input_fd);
+    }
+    std::vector<std::string> argv_str = cmd;
+    std::vector<char*> argv;
+    for (auto& a : argv_str) {
+        argv.push_back(a.data());
+    }
+    argv.push_back(nullptr);
+    execvp(argv[0], argv.data());
+    perror("execv failed");
+    exit(127);
+}
+
+std::pair<size_t, size_t> my_shell::batch_span(const std::vector<std::string>& args) const {
+    // Prefix builtins only cut words off the front of the split line.
+    if (glob_end > glob_begin && split_words >= args.size()) {
+        size_t shift = split_words - args.size();
+        if (glob_begin > shift) return {glob_begin - shift, glob_end - shift};
+    }
+    return {1, args.size()};
+}
+
+void my_shell::run_batched(const std::vector<std::vector<std::string>>& batches, const std::string& input_file,
+                           size_t jobs) {
+    if (jobs == 0) jobs = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+    sigchld_guard guard;
+    std::unordered_set<pid_t> running;
+    size_t next = 0;
+    int combined = 0;
+    while (next < batches.size() || !running.empty()) {
+        while (next < batches.size() && running.size() < jobs) {
+            pid_t pid = fork();
+            if (pid == 0) {
+                guard.restore();
+                exec_command(batches[next], input_file);
+            } else if (pid < 0) {
+                perror("fork failed");
+                combined = std::max(combined, static_cast<int>(ERROR::Other));
+                next = batches.size();
+                break;
+            }
+            running.insert(pid);
+            ++next;
+        }
+        if (running.empty()) break;
+        int status;
+        pid_t done = waitpid(-1, &status, 0);
+        if (done == -1) break;
+        if (running.erase(done) == 0) continue;
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        // Like xargs, any failing invocation fails the whole command;
+        // the highest exit status is reported.
+        combined = std::max(combined, code);
+    }
+    last_status = combined;
+}
+
+void my_shell::mbatch(const std::vector<std::string>& args, const std::string& input_file,
+                      const Redirection& redir) {
+    int stderr_fd = redir.stderr_fd;
+    size_t cmd_start = prefix_cmd_start(args);
+    std::vector<std::string> own_args(args.begin(), args.begin() + cmd_start);
+    if (!own_args.empty() && own_args.back() == "--") own_args.pop_back();
+
+    size_t jobs = 1;
+    size_t max_args = 0;
+    po::variables_map vm;
+    po::options_description mbatch_desc("mbatch options");
+    mbatch_desc.add_options()
+        ("help,h", "Split a command's arguments into as many invocations as ARG_MAX requires: mbatch [options] command [args]")
+        ("jobs,P", po::value<size_t>(&jobs), "Invocations to run in parallel, 0 for one per CPU")
+        ("max-args,n", po::value<size_t>(&max_args), "At most this many batched arguments per invocation");
+
+    if (!parse_args(own_args, mbatch_desc, vm)) return;
+    if (cmd_start >= args.size()) {
+        dprintf(stderr_fd, "Error: Too few arguments\n");
+        last_status = ERROR::WrongArgCount;
+        return;
+    }
+
+    std::vector<std::string> cmd(args.begin() + cmd_start, args.end());
+    std::vector<std::vector<std::string>> batches;
+    auto [begin, end] = batch_span(cmd);
+    if (!split_arg_batches(cmd, begin, end, arg_space(), max_args, batches)) {
+        dprintf(stderr_fd, "Error: A single argument does not fit into ARG_MAX\n");
+        last_status = ERROR::TooManyArgs;
+        return;
+    }
+    run_batched(batches, input_file, jobs);
+}
+
+bool my_shell::run_captured(const std::vector<std::string>& cmd, const std::string& input_file,
+                            cached_result& result) {
+    int out_fd = memfd_create("mcache-stdout", MFD_CLOEXEC);
+    int err_fd = memfd_create("mcache-stderr", MFD_CLOEXEC);
+    if (out_fd == -1 || err_fd == -1) {
+        perror("mcache: memfd_create failed");
+        if (out_fd != -1) close(out_fd);
+        if (err_fd != -1) close(err_fd);
+        return false;
+    }
+
+    sigchld_guard guard;
+    pid_t pid = fork();
+    if (pid == 0) {
+        guard.restore();
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+        is_background = false;
+        exec_command(cmd, input_file);
+    } else if (pid < 0) {
+        perror("fork failed");
+        close(out_fd);
+        close(err_fd);
+        return false;
+    }
+
+    int status = 0;
+    bool exited = waitpid(pid, &status, 0) == pid && WIFEXITED(status);
+    result.status = exited ? WEXITSTATUS(status) : 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    result.out = read_all(out_fd);
+    result.err = read_all(err_fd);
+    close(out_fd);
+    close(err_fd);
+    // A command killed by a signal did not produce a result worth replaying.
+    return exited;
+}
+
+void my_shell::mcache(const std::vector<std::string>& args, const std::string& input_file,
+                      const Redirection& redir) {
+    int stdout_fd = redir.stdout_fd;
+    int stderr_fd = redir.stderr_fd;
+    size_t cmd_start = prefix_cmd_start(args);
+    std::vector<std::string> own_args(args.begin(), args.begin() + cmd_start);
+    if (!own_args.empty() && own_args.back() == "--") own_args.pop_back();
+
+    std::vector<std::string> inputs;
+    std::vector<std::string> env_vars = {"PATH", "LANG", "LC_ALL"};
+    std::vector<std::string> extra_env;
+    po::variables_map vm;
+    po::options_description mcache_desc("mcache options");
+    mcache_desc.add_options()
+        ("help,h", "Replay the stored output of a deterministic command: mcache [options] command [args]")
+        ("input,i", po::value<std::vector<std::string>>(&inputs)->composing(), "Input file the result depends on")
+        ("env,e", po::value<std::vector<std::string>>(&extra_env)->composing(), "Environment variable the result depends on")
+        ("mtime,m", "Fingerprint inputs by size and mtime instead of contents")
+        ("stats", "Print hit/miss statistics of the store")
+        ("clear", "Remove every stored result");
+
+    if (!parse_args(own_args, mcache_desc, vm)) return;
+
+    result_cache cache;
+    if (vm.count("stats")) {
+        auto s = cache.stats();
+        uint64_t lookups = s.hits + s.misses;
+        dprintf(stdout_fd, "store: %s\n", cache.directory().c_str());
+        dprintf(stdout_fd, "hits: %" PRIu64 "\nmisses: %" PRIu64 "\nhit rate: %.1f%%\n", s.hits, s.misses,
+                lookups ? 100.0 * static_cast<double>(s.hits) / static_cast<double>(lookups) : 0.0);
+        dprintf(stdout_fd, "entries: %" PRIu64 "\nsize: %" PRIu64 " / %" PRIu64 " bytes\n", s.entries, s.bytes,
+                result_cache::default_limit());
+        last_status = 0;
+        return;
+    }
+    if (vm.count("clear")) {
+        cache.clear();
+        last_status = 0;
+        return;
+    }
+    if (cmd_start >= args.size()) {
+        dprintf(stderr_fd, "Error: Too few arguments\n");
+        last_status = ERROR::WrongArgCount;
+        return;
+    }
+
+    std::vector<std::string> cmd(args.begin() + cmd_start, args.end());
+    if (!input_file.empty()) inputs.push_back(input_file);
+    env_vars.insert(env_vars.end(), extra_env.begin(), extra_env.end());
+
+    // stdin is keyed only when it is a '<' file or a here-doc. A command
+    // started from a terminal gets /dev/null instead; any other stdin (a
+    // pipe, or a file the shell inherited) cannot be keyed, so the command
+    // runs uncached.
+    std::string run_input = input_file;
+    bool cacheable = true;
+    if (input_file.empty() && !redir.stdin_redirected) {
+        if (isatty(STDIN_FILENO)) run_input = "/dev/null";
+        else cacheable = false;
+    }
+
+    std::string descriptor, error;
+    if (cacheable && !cache.describe(cmd, env_vars, inputs, redir.stdin_redirected ? &redir.stdin_data : nullptr,
+                                     vm.count("mtime") != 0, descriptor, error)) {
+        dprintf(stderr_fd, "Error: %s\n", error.c_str());
+        last_status = ERROR::FileNotFound;
+        return;
+    }
+
+    cached_result result;
+    if (!cacheable) {
+        run_captured(cmd, run_input, result);
+    } else if (!cache.lookup(descriptor, result)) {
+        if (run_captured(cmd, run_input, result)) {
+            cache.store(descriptor, result);
+        }
+    }
+    // Output is replayed stream by stream; the original interleaving of
+    // stdout and stderr is not preserved.
+    write_all(stdout_fd, result.out);
+    write_all(stderr_fd, result.err);
+    last_status = result.status;
+}
+
+void my_shell::mtime(const std::vector<std::string>& args, const std::string& input_file,
+                     const Redirection& redir) {
+    int stderr_fd = redir.stderr_fd;
+    size_t cmd_start = prefix_cmd_start(args);
+    std::vector<std::string> own_args(args.begin(), args.begin() + cmd_start);
+    if (!own_args.empty() && own_args.back() == "--") own_args.pop_back();
+
+    po::variables_map vm;
+    po::options_description mtime_desc("mtime options");
+    mtime_desc.add_options()
+        ("help,h", "Run a command and report its wall time, CPU time, max RSS and context switches");
+
+    if (!parse_args(own_args, mtime_desc, vm)) return;
+    if (cmd_start >= args.size()) {
+        dprintf(stderr_fd, "Error: Too few arguments\n");
+        last_status = ERROR::WrongArgCount;
+        return;
+    }
+    std::vector<std::string> cmd(args.begin() + cmd_start, args.end());
+
+    rusage usage{};
+    auto start = std::chrono::steady_clock::now();
+    if (prefix_cmds_m.count(cmd[0]) || internal_cmds_m.count(cmd[0])) {
+        // Builtins run in the shell itself: take the difference of the shell
+        // thread's usage plus that of the children it waited for meanwhile
+        // (mcache, mtaskset and mbatch run their commands as children). The
+        // kernel keeps only a lifetime peak for children, so max RSS is the
+        // larger of the shell's and that peak.
+        rusage before{}, after{}, children_before{}, children_after{};
+        getrusage(RUSAGE_THREAD, &before);
+        getrusage(RUSAGE_CHILDREN, &children_before);
+        run_command(cmd, input_file, redir);
+        getrusage(RUSAGE_THREAD, &after);
+        getrusage(RUSAGE_CHILDREN, &children_after);
+        timeval children_utime{}, children_stime{};
+        timersub(&after.ru_utime, &before.ru_utime, &usage.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &usage.ru_stime);
+        timersub(&children_after.ru_utime, &children_before.ru_utime, &children_utime);
+        timersub(&children_after.ru_stime, &children_before.ru_stime, &children_stime);
+        timeradd(&usage.ru_utime, &children_utime, &usage.ru_utime);
+        timeradd(&usage.ru_stime, &children_stime, &usage.ru_stime);
+        usage.ru_maxrss = std::max(after.ru_maxrss, children_after.ru_maxrss);
+        usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw + children_after.ru_nvcsw - children_before.ru_nvcsw;
+        usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw + children_after.ru_nivcsw - children_before.ru_nivcsw;
+    } else {
+        sigchld_guard guard;
+        pid_t pid = fork();
+        if (pid == 0) {
+            guard.restore();
+            exec_command(cmd, input_file);
+        } else if (pid < 0) {
+            perror("fork failed");
+            last_status = ERROR::Other;
+            return;
+        }
+        int status = 0;
+        if (wait4(pid, &status, 0, &usage) == pid) {
+            last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+        stats.record(command_stats::kind::external, cmd[0], elapsed_us(start));
+    }
+    double real = static_cast<double>(elapsed_us(start)) / 1e6;
+
+    dprintf(stderr_fd, "real    %.3fs\n", real);
+    dprintf(stderr_fd, "user    %.3fs\n", timeval_s(usage.ru_utime));
+    dprintf(stderr_fd, "sys     %.3fs\n", timeval_s(usage.ru_stime));
+    dprintf(stderr_fd, "maxrss  %ld KiB\n", usage.ru_maxrss);
+    dprintf(stderr_fd, "ctxsw   %ld voluntary, %ld involuntary\n", usage.ru_nvcsw, usage.ru_nivcsw);
+}
+
+void my_shell::mstats(const std::vector<std::string>& args, const Redirection& redir) {
+    int stdout_fd = redir.stdout_fd;
+    po::variables_map vm;
+    po::options_description mstats_desc("mstats options");
+    mstats_desc.add_options()
+        ("help,h", "Print latency statistics of the commands run in this session")
+        ("json,j", "Print as JSON")
+        ("reset,r", "Forget everything recorded so far");
+
+    if (!parse_args(args, mstats_desc, vm)) return;
+    if (vm.count("reset")) {
+        stats.reset();
+    } else if (vm.count("json")) {
+        stats.dump_json(stdout_fd);
+    } else {
+        stats.dump_text(stdout_fd);
+    }
+    last_status = 0;
+}
+
 std::string my_shell::read_line() {
     char* line = readline((std::filesystem::current_path().string() + " $ ").c_str());
     if (line == nullptr) {
@@ -435,17 +1160,115 @@ std::string my_shell::read_line() {
     
     if (!result.empty()) {
         add_history(line);
+        history.append(result);
     }
     
     free(line); 
     return result;
 }
 
+size_t my_shell::find_redirect(const std::string& line, const std::string& op) {
+    int depth = 0;
+    for (size_t i = 0; i < line.size(); ++i) {
+        if ((line[i] == '<' || line[i] == '>') && i + 1 < line.size() && line[i + 1] == '(') {
+            ++depth;
+            ++i;
+        } else if (line[i] == ')' && depth > 0) {
+            --depth;
+        } else if (depth == 0 && line.compare(i, op.size(), op) == 0) {
+            // A plain ">" must not match the tail of "2>" or "&>".
+            bool tail = op == ">" && i > 0 &&
+                        (line[i - 1] == '&' || (line[i - 1] == '2' && (i == 1 || isspace(line[i - 2]))));
+            if (!tail) return i;
+        }
+    }
+    return std::string::npos;
+}
+
+std::string my_shell::expand_process_substitutions(const std::string& line) {
+    std::string res;
+    for (size_t i = 0; i < line.size(); ++i) {
+        bool opens = (line[i] == '<' || line[i] == '>') && i + 1 < line.size() && line[i + 1] == '(';
+        if (!opens) {
+            res += line[i];
+            continue;
+        }
+        int depth = 1;
+        size_t end = i + 2;
+        for (; end < line.size() && depth > 0; ++end) {
+            if (line[end] == '(') ++depth;
+            else if (line[end] == ')') --depth;
+        }
+        if (depth > 0) {
+            res += line.substr(i);
+            break;
+        }
+        res += launch_process_substitution(line.substr(i + 2, end - i - 3), line[i] == '<');
+        i = end - 1;
+    }
+    return res;
+}
+
+std::string my_shell::launch_process_substitution(const std::string& cmd, bool output_to_parent) {
+    int fd[2];
+    if (pipe(fd) == -1) {
+        perror("Failed to create pipe for process substitution");
+        return "/dev/null";
+    }
+    // <(cmd): the outer command reads what cmd writes; >(cmd): the reverse.
+    int parent_end = output_to_parent ? fd[0] : fd[1];
+    int child_end = output_to_parent ? fd[1] : fd[0];
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Other substitutions' pipe ends must not stay open here, or their
+        // readers would never see EOF.
+        for (const auto& sub : proc_subs) {
+            close(sub.fd);
+        }
+        close(parent_end);
+        dup2(child_end, output_to_parent ? STDOUT_FILENO : STDIN_FILENO);
+        close(child_end);
+        proc_subs.clear();
+        is_background = false;
+
+        std::string inner = cmd;
+        Redirection redir = handle_redirection(inner);
+        auto pipe_line = split_pipe(inner);
+        if (pipe_line.size() > 1) pipe_execute(pipe_line, redir);
+        else execute(inner, redir);
+        exit(last_status);
+    } else if (pid < 0) {
+        perror("fork failed");
+        close(parent_end);
+        close(child_end);
+        return "/dev/null";
+    }
+    close(child_end);
+    proc_subs.push_back({pid, parent_end});
+    return "/dev/fd/" + std::to_string(parent_end);
+}
+
+void my_shell::reap_process_substitutions() {
+    // Closing our ends first gives >(cmd) its EOF and <(cmd) a SIGPIPE if
+    // the outer command stopped reading early.
+    for (const auto& sub : proc_subs) {
+        close(sub.fd);
+    }
+    if (!is_background) {
+        for (const auto& sub : proc_subs) {
+            waitpid(sub.pid, nullptr, 0);
+        }
+    }
+    proc_subs.clear();
+}
+
 std::pair<std::vector<char *>, std::string> my_shell::split_line(const std::string& line) {
     std::vector<char *> args;
     
     auto line_stripped = line.substr(0, line.find('#'));
     if (line_stripped.empty()) return std::make_pair(args, "");
+    line_stripped = expand_process_substitutions(line_stripped);
     std::istringstream iss(line_stripped);
     std::string token;
     std::vector<std::string> tokens;
@@ -466,12 +1289,15 @@ std::pair<std::vector<char *>, std::string> my_shell::split_line(const std::stri
         input_file = *(std::next(it));
         tokens.erase(it, std::next(it, 2));
     }
+    glob_begin = glob_end = 0;
     for (auto& tok : tokens) {
         if (tok.find('*') != std::string::npos || tok.find('?') != std::string::npos || tok.find('[') != std::string::npos) {
             glob_t glob_result;
             glob(tok.c_str(), GLOB_TILDE, nullptr, &glob_result);
 
             if (glob_result.gl_pathc > 0) {
+                if (glob_end == 0) glob_begin = args.size();
+                glob_end = args.size() + glob_result.gl_pathc;
                 for (size_t i = 0; i < glob_result.gl_pathc; ++i) {
                     args.push_back(strdup(glob_result.gl_pathv[i]));
                 }
@@ -483,6 +1309,7 @@ std::pair<std::vector<char *>, std::string> my_shell::split_line(const std::stri
             args.push_back(strdup(tok.c_str()));
         }
     }
+    split_words = args.size();
     args.push_back(nullptr);
     if (!input_file.empty()) {
         return std::make_pair(args, input_file);
@@ -494,12 +1321,24 @@ std::pair<std::vector<char *>, std::string> my_shell::split_line(const std::stri
 std::vector<std::string> my_shell::split_pipe(const std::string &line)
 {
     std::vector<std::string> tokens;
-    std::stringstream ss(line);
     std::string token;
-
-    while (std::getline(ss, token, '|')) {
-        tokens.push_back(token); 
+    int depth = 0;
+
+    // A '|' inside <(...) or >(...) belongs to the substituted command.
+    for (size_t i = 0; i < line.size(); ++i) {
+        if ((line[i] == '<' || line[i] == '>') && i + 1 < line.size() && line[i + 1] == '(') {
+            ++depth;
+            token += line[i++];
+        } else if (line[i] == ')' && depth > 0) {
+            --depth;
+        } else if (line[i] == '|' && depth == 0) {
+            tokens.push_back(token);
+            token.clear();
+            continue;
+        }
+        token += line[i];
     }
+    if (!token.empty()) tokens.push_back(token);
 
     return tokens;
 }
@@ -513,11 +1352,21 @@ void my_shell::run_script(const std::string& filename) {
     }
 
     std::string line;
+    auto next_line = [&file](std::string& body_line) {
+        return static_cast<bool>(std::getline(file, body_line));
+    };
     while (std::getline(file, line)) {
+        auto here_input = extract_here_input(line, next_line);
         Redirection redir = handle_redirection(line);
+        if (here_input) redirect_stdin(redir, *here_input);
         auto [args, input_file] = split_line(line);
-        if (args.empty()) continue;
-        if (internal_cmds_m.find(args[0]) != internal_cmds_m.end()) {
+        if (args.empty()) {
+            restore_redirection(redir);
+            continue;
+        }
+        if (prefix_cmds_m.find(args[0]) != prefix_cmds_m.end()) {
+            run_command(convert_to_str_vec(args), input_file, redir);
+        } else if (internal_cmds_m.find(args[0]) != internal_cmds_m.end()) {
             auto f = internal_cmds_m[args[0]];
             auto str_vec = convert_to_str_vec(args);
             run_internal(f, str_vec, redir);
@@ -525,15 +1374,41 @@ void my_shell::run_script(const std::string& filename) {
             run_external(args, input_file);
         }
         restore_redirection(redir);
+        reap_process_substitutions();
     }
     file.close();
 }
 
 
 
+bool my_shell::run_auto_batched(const std::vector<char*>& args, const std::string& input_file) {
+    const char* auto_batch = std::getenv("MSHELL_AUTO_BATCH");
+    if (!auto_batch || strcmp(auto_batch, "1") != 0) return false;
+
+    auto str_vec = convert_to_str_vec(args);
+    size_t space = arg_space();
+    size_t needed = 0;
+    for (const auto& a : str_vec) {
+        needed += arg_cost(a);
+    }
+    std::vector<std::vector<std::string>> batches;
+    auto [begin, end] = batch_span(str_vec);
+    if (needed <= space || !split_arg_batches(str_vec, begin, end, space, 0, batches)) {
+        return false;
+    }
+    const char* jobs = std::getenv("MSHELL_BATCH_JOBS");
+    run_batched(batches, input_file, jobs ? strtoul(jobs, nullptr, 10) : 1);
+    return true;
+}
+
 void my_shell::run_external(std::vector<char*>& args, const std::string& input_file) {
     pid_t pid, wpid;
     int status;
+    auto start = std::chrono::steady_clock::now();
+    if (!is_background && run_auto_batched(args, input_file)) {
+        stats.record(command_stats::kind::external, args[0], elapsed_us(start));
+        return;
+    }
     pid = fork();
     if (pid == 0) {
         if (!input_file.empty()) {
@@ -566,6 +1441,7 @@ void my_shell::run_external(std::vector<char*>& args, const std::string& input_f
             waitpid(pid, &status, 0);
             if ( WIFEXITED(status) )
                 last_status = WEXITSTATUS(status);        
+            stats.record(command_stats::kind::external, args[0], elapsed_us(start));
             }
     } else {
         perror("fork failed");
@@ -573,71 +1449,135 @@ void my_shell::run_external(std::vector<char*>& args, const std::string& input_f
 }
 
 void my_shell::run_internal(std::function<void(const std::vector<std::string>&, const Redirection&)>& f,
-                            const std::vector<std::string>& args, const Redirection& redir) {
+                            const std::vector<std::string>& args, const Redirection& redir,
+                            const std::string& name) {
+    auto start = std::chrono::steady_clock::now();
     f(args, redir);
+    if (!name.empty()) stats.record(command_stats::kind::builtin, name, elapsed_us(start));
+    else if (!args.empty()) stats.record(command_stats::kind::builtin, args[0], elapsed_us(start));
 }
 
-void my_shell::pipe_execute(std::vector<std::string>& pipe_line, Redirection& redir) {
+void my_shell::run_command(const std::vector<std::string>& args, const std::string& input_file,
+                           const Redirection& redir) {
+    if (args.empty()) return;
+    if (prefix_cmds_m.find(args[0]) != prefix_cmds_m.end()) {
+        auto start = std::chrono::steady_clock::now();
+        prefix_cmds_m[args[0]](args, input_file, redir);
+        stats.record(command_stats::kind::builtin, args[0], elapsed_us(start));
+    } else if (internal_cmds_m.find(args[0]) != internal_cmds_m.end()) {
+        run_internal(internal_cmds_m[args[0]], args, redir);
+    } else {
+        std::vector<std::string> argv_str = args;
+        std::vector<char*> argv;
+        for (auto& a : argv_str) {
+            argv.push_back(a.data());
+        }
+        argv.push_back(nullptr);
+        run_external(argv, input_file);
+    }
+}
+
+std::vector<int> my_shell::pipeline_placement(size_t stages) {
+    const char* pin = std::getenv("MSHELL_PIPE_AFFINITY");
+    if (!pin || strcmp(pin, "1") != 0) return {};
+    if (!topology.loaded()) topology.load();
+    return topology.place_pipeline(stages);
+}
+
+void my_shell::exec_stage(const std::vector<char*>& args, const std::string& input_file) {
+    if (args.empty() || args[0] == nullptr) exit(0);
+    bool builtin = prefix_cmds_m.count(args[0]) || internal_cmds_m.count(args[0]);
+    if (!builtin && run_auto_batched(args, input_file)) exit(last_status);
+    exec_command(convert_to_str_vec(args), input_file);
+}
+
+void my_shell::pipe_execute(std::vector<std::string>& pipe_line, Redirection& redir,
+                            const std::vector<std::optional<std::string>>& here_inputs) {
     size_t i;
     int status;
     int fd[2];
+    std::vector<pid_t> pids;
+    auto placement = pipeline_placement(pipe_line.size());
+    auto start = std::chrono::steady_clock::now();
 
     int stdout_d = dup(1);
     int stdin_d = dup(0);
 
-
+    // All stages are started before any is waited for: a producer that
+    // writes more than a pipe buffer would otherwise block forever.
     for( i=0; i < pipe_line.size()-1; ++i)
     {
         auto cmd = pipe_line[i];
         auto [args, input_file] = split_line(cmd);
+        int here_fd = i < here_inputs.size() && here_inputs[i] ? here_input_fd(*here_inputs[i]) : -1;
         pipe(fd);
-        if (!fork()) {
+        pid_t pid = fork();
+        if (!pid) {
+            if (!placement.empty()) pin_to_cpus({placement[i]});
             dup2(fd[1], 1);
             close(fd[0]);
-            if (internal_cmds_m.find(args[0]) != internal_cmds_m.end() && i == 0) {
-                auto f = internal_cmds_m[args[0]];
-                auto str_vec = convert_to_str_vec(args);
-                Redirection redir_internal;
-                redir_internal.stdout_redirected = true;
-                redir_internal.stdout_fd = fd[1];
-                run_internal(f, str_vec, redir_internal);
-                exit(0);
-            } else{
-                execlp(args[0], args[0], NULL);
-                perror("exec");
-                abort();
-            }
+            close(fd[1]);
+            if (here_fd != -1) dup2(here_fd, 0);
+            exec_stage(args, input_file);
         }
+        if (here_fd != -1) close(here_fd);
+        pids.push_back(pid);
         dup2(fd[0], 0);
+        close(fd[0]);
         close(fd[1]);
-        waitpid(-1, &status, 0);
     }
 
-    if (!fork()) {
-        auto cmd = pipe_line[pipe_line.size()-1];
-        auto [args, input_file] = split_line(cmd);
+    auto [last_args, last_input_file] = split_line(pipe_line[pipe_line.size()-1]);
+    int here_fd = i < here_inputs.size() && here_inputs[i] ? here_input_fd(*here_inputs[i]) : -1;
+    pid_t pid = fork();
+    if (!pid) {
+        if (!placement.empty()) pin_to_cpus({placement[i]});
+        auto& args = last_args;
         if (redir.stdout_redirected) {
             dup2(redir.stdout_fd, 1);
         }
-        execlp(args[0], args[0], NULL);
-        perror("exec");
-    } else {
-        wait(nullptr);
+        if (here_fd != -1) dup2(here_fd, 0);
+        exec_stage(args, last_input_file);
     }
-    dup2(stdout_d, 1);
+    if (here_fd != -1) close(here_fd);
     dup2(stdin_d, 0);
+    close(stdin_d);
+    for (pid_t stage : pids) {
+        waitpid(stage, nullptr, 0);
+    }
+    if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status)) {
+        last_status = WEXITSTATUS(status);
+    }
+    dup2(stdout_d, 1);
+    close(stdout_d);
     restore_redirection(redir);
+    reap_process_substitutions();
+
+    std::string name;
+    for (const auto& stage : pipe_line) {
+        std::istringstream stage_iss(stage);
+        std::string word;
+        stage_iss >> word;
+        name += (name.empty() ? "" : " | ") + word;
+    }
+    stats.record(command_stats::kind::pipeline, name, elapsed_us(start));
 
 }
 
 void my_shell::execute(std::string& line, Redirection& redir) {
     auto [args, input_file] = split_line(line);
-    if (args.empty()) return;
+    if (args.empty()) {
+        restore_redirection(redir);
+        return;
+    }
     std::string arg = args[0];
-    if (internal_cmds_m.find(arg) != internal_cmds_m.end()) {
+    if (prefix_cmds_m.find(arg) != prefix_cmds_m.end()) {
+        run_command(convert_to_str_vec(args), input_file, redir);
+    } else if (internal_cmds_m.find(arg) != internal_cmds_m.end()) {
         auto f = internal_cmds_m[arg];
         if (arg=="mexport") {
-            mexport({line}, redir);
+            // mexport parses the raw line itself.
+            run_internal(f, {line}, redir, arg);
         } else {
             auto str_vec = convert_to_str_vec(args);
             run_internal(f, str_vec, redir);
@@ -645,31 +1585,69 @@ void my_shell::execute(std::string& line, Redirection& redir) {
     } else {
         run_external(args, input_file);
     }
+    // The shell's own copy of a >(cmd) target must be closed first, or cmd
+    // never sees EOF.
     restore_redirection(redir);
+    reap_process_substitutions();
 }
 
 
 void my_shell::run() {
-    read_history("history.txt");
+    if (history.open()) {
+        const char* size = std::getenv("MSHELL_HISTSIZE");
+        int histsize = size ? std::atoi(size) : 1000;
+        if (histsize > 0) {
+            stifle_history(histsize);
+            history.load_recent(histsize, [](const std::string& entry) { add_history(entry.c_str()); });
+        }
+    }
     while (true) {
         auto line = read_line();
         if (line.empty()) continue;
 
+        auto next_line = [](std::string& body_line) {
+            char* l = readline("> ");
+            if (l == nullptr) return false;
+            body_line = l;
+            free(l);
+            return true;
+        };
+        // Each stage may have its own here-document; bodies are read in
+        // stage order and only feed the stage that declared them.
         auto pipe_line = split_pipe(line);
-        auto [last_args, input_file] = split_line(pipe_line[pipe_line.size()-1]);
-
-        if (strcmp(last_args[last_args.size()-2], "&") == 0) {
-            is_background = true;
-            last_args.pop_back();
-            last_args[last_args.size()-1] = nullptr;
-        } else is_background = false;
-        
+        std::vector<std::optional<std::string>> here_inputs;
+        line.clear();
+        for (auto& stage : pipe_line) {
+            if (!here_inputs.empty()) line += '|';
+            here_inputs.push_back(extract_here_input(stage, next_line));
+            line += stage;
+        }
+        // "<<< word" or "<<EOF" alone leaves nothing to run.
+        if (line.find_first_not_of(" \t") == std::string::npos) continue;
+
+        // Only the last word is needed here; split_line would also start
+        // any process substitutions a second time.
+        std::istringstream last_iss(line);
+        std::string word, last_word;
+        while (last_iss >> word) last_word = word;
+        is_background = last_word == "&";
+
+        // Redirections are cut off before the line is split into stages,
+        // so the last stage does not see them (or start a >(cmd) target twice).
         Redirection redir = handle_redirection(line);
+        pipe_line = split_pipe(line);
+        if (pipe_line.empty()) {
+            restore_redirection(redir);
+            continue;
+        }
 
-        if ( pipe_line.size() > 1 ) pipe_execute(pipe_line, redir);
-        else execute(line, redir);
+        if ( pipe_line.size() > 1 ) {
+            pipe_execute(pipe_line, redir, here_inputs);
+        } else {
+            if (here_inputs[0]) redirect_stdin(redir, *here_inputs[0]);
+            execute(line, redir);
+        }
 
         redirecting = false;
     }
-    write_history("history.txt");
 }
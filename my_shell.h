@@ -14,6 +14,18 @@
 #include <dirent.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <optional>
+#include <cinttypes>
+#include <chrono>
+#include <sys/resource.h>
+#include <linux/mempolicy.h>
+#include "completion.h"
+#include "cpu_topology.h"
+#include "result_cache.h"
+#include "history_log.h"
+#include "cmd_stats.h"
 
 namespace po = boost::program_options;
 
@@ -25,6 +37,11 @@ enum ERROR {
     Other=5
 };
 
+struct ProcessSubstitution {
+    pid_t pid;
+    int fd;
+};
+
 struct Redirection {
     int stdout_fd = STDOUT_FILENO;
     int stderr_fd = STDERR_FILENO;
@@ -32,14 +49,29 @@ struct Redirection {
     bool stderr_redirected = false;
     int stdout_backup = -1;
     int stderr_backup = -1;
+    bool stdin_redirected = false;
+    int stdin_backup = -1;
+    std::string stdin_data;   // here-doc body behind a redirected stdin
 };
 
 class my_shell {
 private:
     std::unordered_map<std::string, std::function<void(const std::vector<std::string>&, const Redirection&)>> internal_cmds_m;
+    // Builtins that wrap another command and need its `<` input file.
+    std::unordered_map<std::string, std::function<void(const std::vector<std::string>&, const std::string&, const Redirection&)>> prefix_cmds_m;
     int last_status = 0;
     bool is_background = false;
     bool redirecting = false;
+    completion_index completion;
+    cpu_topology topology;
+    history_log history;
+    command_stats stats;
+    std::vector<ProcessSubstitution> proc_subs;
+    // Words of the last split line, and the [begin, end) range its globs
+    // expanded to; batching splits only that range.
+    size_t split_words = 0;
+    size_t glob_begin = 0;
+    size_t glob_end = 0;
 public:
     my_shell(int argc=1, char** argv=nullptr);
     ~my_shell() = default;
@@ -49,19 +81,37 @@ private:
     std::string read_line();
     std::pair<std::vector<char *>, std::string> split_line(const std::string& line);
     std::vector<std::string> split_pipe(const std::string& line);
+    size_t find_redirect(const std::string& line, const std::string& op);
+    std::string expand_process_substitutions(const std::string& line);
+    std::string launch_process_substitution(const std::string& cmd, bool output_to_parent);
+    void reap_process_substitutions();
     Redirection handle_redirection(std::string& line);
+    //! Opens the redirection target at the start of rest: a file name or a
+    //  >(cmd) / <(cmd) process substitution. Returns -1 after printing an error.
+    int open_redirect_target(const std::string& rest, const char* open_error);
     void restore_redirection(const Redirection& redir);
+    std::optional<std::string> extract_here_input(std::string& line,
+                                                  const std::function<bool(std::string&)>& next_line);
+    int here_input_fd(const std::string& body);
+    void redirect_stdin(Redirection& redir, const std::string& body);
+    std::string expand_vars(const std::string& text);
 
     void execute(std::string& line, Redirection& redir);
-    void pipe_execute(std::vector<std::string>& pipe_line, Redirection& redir);
+    void pipe_execute(std::vector<std::string>& pipe_line, Redirection& redir,
+                      const std::vector<std::optional<std::string>>& here_inputs = {});
+    [[noreturn]] void exec_stage(const std::vector<char*>& args, const std::string& input_file);
+    std::vector<int> pipeline_placement(size_t stages);
 
     void show_help(const po::options_description& desc);
     bool parse_args(const std::vector<std::string>& args, 
                           const po::options_description& desc, po::variables_map& vm);
  
     void run_external(std::vector<char*>& args, const std::string& input_file = "");
-    void run_internal(std::function<void(const std::vector<std::string>&, const Redirection&)>& f, const std::vector<std::string>& args, const Redirection& redir);
+    void run_internal(std::function<void(const std::vector<std::string>&, const Redirection&)>& f, const std::vector<std::string>& args, const Redirection& redir,
+                      const std::string& name = "");
     void run_script(const std::string& filename);
+    void run_command(const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir);
+    size_t prefix_cmd_start(const std::vector<std::string>& args);
 
     void mpwd(const std::vector<std::string>& args, const Redirection& redir);
     void mcd(const std::vector<std::string>& args, const Redirection& redir);
@@ -70,6 +120,16 @@ private:
     void mecho(const std::vector<std::string>& args, const Redirection& redir);
     void point(const std::vector<std::string>& args, const Redirection& redir);
     void mexport(const std::vector<std::string>& args, const Redirection& redir);
+    void mtaskset(const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir);
+    void mcache(const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir);
+    bool run_captured(const std::vector<std::string>& cmd, const std::string& input_file, cached_result& result);
+    void mbatch(const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir);
+    void run_batched(const std::vector<std::vector<std::string>>& batches, const std::string& input_file, size_t jobs);
+    std::pair<size_t, size_t> batch_span(const std::vector<std::string>& args) const;
+    bool run_auto_batched(const std::vector<char*>& args, const std::string& input_file);
+    [[noreturn]] void exec_command(const std::vector<std::string>& cmd, const std::string& input_file);
+    void mtime(const std::vector<std::string>& args, const std::string& input_file, const Redirection& redir);
+    void mstats(const std::vector<std::string>& args, const Redirection& redir);
 
     std::vector<std::string> convert_to_str_vec(const std::vector<char*>& char_vect);
 };
\ No newline at end of file
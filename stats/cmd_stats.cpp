@@ -0,0 +1,101 @@
+#include "cmd_stats.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+
+namespace {
+
+const char* kind_name(command_stats::kind k) {
+    switch (k) {
+        case command_stats::kind::external: return "external";
+        case command_stats::kind::builtin: return "builtin";
+        case command_stats::kind::pipeline: return "pipeline";
+    }
+    return "unknown";
+}
+
+std::string json_escape(const std::string& s) {
+    std::string res;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        } else {
+            res += c;
+        }
+    }
+    return res;
+}
+
+} // namespace
+
+size_t latency_histogram::index_of(uint64_t us) {
+    if (us < 2 * half) return us;
+    unsigned msb = 63 - __builtin_clzll(us);
+    unsigned bucket = msb - sub_bits + 1;
+    uint64_t sub = us >> bucket;
+    return (bucket + 1) * half + (sub - half);
+}
+
+uint64_t latency_histogram::highest_in(size_t index) {
+    if (index < 2 * half) return index;
+    unsigned bucket = index / half - 1;
+    uint64_t sub = index % half + half;
+    return ((sub + 1) << bucket) - 1;
+}
+
+void latency_histogram::record(uint64_t us) {
+    size_t idx = index_of(us);
+    if (idx >= counts.size()) counts.resize(idx + 1);
+    ++counts[idx];
+    ++total;
+    sum_us += us;
+    min_us = std::min(min_us, us);
+    max_us = std::max(max_us, us);
+}
+
+uint64_t latency_histogram::percentile(double p) const {
+    if (total == 0) return 0;
+    auto target = static_cast<uint64_t>(std::ceil(p / 100.0 * static_cast<double>(total)));
+    target = std::max<uint64_t>(target, 1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); ++i) {
+        seen += counts[i];
+        if (seen >= target) return std::min(highest_in(i), max_us);
+    }
+    return max_us;
+}
+
+void command_stats::record(kind k, const std::string& name, uint64_t wall_us) {
+    hists[{k, name}].record(wall_us);
+}
+
+void command_stats::dump_text(int fd) const {
+    dprintf(fd, "%-9s %-24s %7s %10s %10s %10s %10s %10s\n",
+            "kind", "name", "count", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (const auto& [key, h] : hists) {
+        dprintf(fd, "%-9s %-24s %7" PRIu64 " %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                kind_name(key.first), key.second.c_str(), h.count(), h.mean() / 1000.0,
+                static_cast<double>(h.percentile(50)) / 1000.0, static_cast<double>(h.percentile(90)) / 1000.0,
+                static_cast<double>(h.percentile(99)) / 1000.0, static_cast<double>(h.max()) / 1000.0);
+    }
+}
+
+void command_stats::dump_json(int fd) const {
+    dprintf(fd, "{\"unit\":\"us\",\"commands\":[");
+    bool first = true;
+    for (const auto& [key, h] : hists) {
+        dprintf(fd, "%s\n  {\"kind\":\"%s\",\"name\":\"%s\",\"count\":%" PRIu64 ",\"mean\":%.1f,"
+                    "\"min\":%" PRIu64 ",\"p50\":%" PRIu64 ",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+                first ? "" : ",", kind_name(key.first), json_escape(key.second).c_str(), h.count(), h.mean(),
+                h.min(), h.percentile(50), h.percentile(90), h.percentile(99), h.max());
+        first = false;
+    }
+    dprintf(fd, "\n]}\n");
+}
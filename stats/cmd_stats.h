@@ -0,0 +1,55 @@
+#ifndef MYSHELL_CMD_STATS_H
+#define MYSHELL_CMD_STATS_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//! HDR-style latency histogram: exact below 32 us, then 16 log-linear
+//  sub-buckets per power of two, so every recorded value is kept to
+//  within ~6% at any magnitude. Recording is one index computation and
+//  an increment; the bucket array only grows as large as the largest
+//  value needs.
+class latency_histogram {
+public:
+    void record(uint64_t us);
+
+    [[nodiscard]] uint64_t count() const { return total; }
+    [[nodiscard]] uint64_t min() const { return total ? min_us : 0; }
+    [[nodiscard]] uint64_t max() const { return max_us; }
+    [[nodiscard]] double mean() const { return total ? static_cast<double>(sum_us) / static_cast<double>(total) : 0; }
+    //! Highest value equivalent to the bucket holding the p-th percentile.
+    [[nodiscard]] uint64_t percentile(double p) const;
+
+private:
+    static constexpr unsigned sub_bits = 5;
+    static constexpr uint64_t half = 1ULL << (sub_bits - 1);
+
+    static size_t index_of(uint64_t us);
+    static uint64_t highest_in(size_t index);
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum_us = 0;
+    uint64_t min_us = UINT64_MAX;
+    uint64_t max_us = 0;
+};
+
+//! Session-wide wall-time histograms, one per command name and kind.
+class command_stats {
+public:
+    enum class kind { external, builtin, pipeline };
+
+    void record(kind k, const std::string& name, uint64_t wall_us);
+    void reset() { hists.clear(); }
+
+    void dump_text(int fd) const;
+    void dump_json(int fd) const;
+
+private:
+    std::map<std::pair<kind, std::string>, latency_histogram> hists;
+};
+
+#endif //MYSHELL_CMD_STATS_H